@@ -2,9 +2,12 @@
 #define arrays_H
 
 #include "fbsparsearray4d.h"
+#include "fbarena.h"
 #include <malloc.h>
 #include <QVector>
 #include <QDebug>
+#include <QAtomicInt>
+#include <string.h>
 
 template <class TT> class FBArray1DPrivate;
 template <class T>
@@ -14,8 +17,14 @@ public:
 	FBArray1D();
 	FBArray1D(const FBArray1D &X);
 	void operator=(const FBArray1D &X);
+#ifdef Q_COMPILER_RVALUE_REFS
+	FBArray1D(FBArray1D &&X); //takes over the data of X, leaving X empty
+	void operator=(FBArray1D &&X);
+#endif
 	virtual ~FBArray1D();
+	void swap(FBArray1D &X); //exchanges the data without copying
 	void allocate(long N);
+	void allocate(long N,FBArena *arena); //zero-initialized memory owned by the arena (see FBArena::release)
 	void setAll(T val);	
 	long length() const;
 	void clear();
@@ -30,10 +39,15 @@ class FBArray1DPrivate {
 public:
 	FBArray1D<TT> *q;
 	long m_N;
+	bool m_owned; //false if ptr belongs to an FBArena
 	void copy_from(const FBArray1D<TT> &X) {
+		if (X.d==this) return;
+		if (!X.d->m_N) {
+			q->clear();
+			return;
+		}
 		if (X.d->m_N!=m_N) q->allocate(X.d->m_N);
-		for (long i=0; i<m_N; i++)
-			q->ptr[i]=X.d->q->ptr[i];
+		if (q->ptr) memcpy(q->ptr,X.ptr,sizeof(TT)*m_N);
 	}
 };
 
@@ -43,8 +57,12 @@ class FBArray4D {
 public:
 	template <class TT> friend class FBArray4DPrivate;
 	FBArray4D();
-	FBArray4D(const FBArray4D &X);
+	FBArray4D(const FBArray4D &X); //shares the data with X until one of them is modified
 	void operator=(const FBArray4D &X);
+#ifdef Q_COMPILER_RVALUE_REFS
+	FBArray4D(FBArray4D &&X);
+	void operator=(FBArray4D &&X);
+#endif
 	virtual ~FBArray4D();
 	void allocate(long N1,long N2,long N3,long N4);	
 	T value(long i1,long i2,long i3,long i4) const ;
@@ -88,40 +106,74 @@ template <class T> FBArray1D<T>::FBArray1D()
 	d->q=this;
 	ptr=0;
 	d->m_N=0;
+	d->m_owned=true;
 }
 template <class T> FBArray1D<T>::FBArray1D(const FBArray1D &X) {
 	d=new FBArray1DPrivate<T>;
 	d->q=this;
 	ptr=0;
 	d->m_N=0;
+	d->m_owned=true;
 	d->copy_from(X);
 }
 template <class T> void FBArray1D<T>::operator=(const FBArray1D &X) {
 	d->copy_from(X);
 }
+#ifdef Q_COMPILER_RVALUE_REFS
+template <class T> FBArray1D<T>::FBArray1D(FBArray1D &&X) {
+	d=new FBArray1DPrivate<T>;
+	d->q=this;
+	ptr=0;
+	d->m_N=0;
+	d->m_owned=true;
+	swap(X);
+}
+template <class T> void FBArray1D<T>::operator=(FBArray1D &&X) {
+	clear();
+	swap(X);
+}
+#endif
+template <class T> void FBArray1D<T>::swap(FBArray1D &X) {
+	T *tmp_ptr=ptr; ptr=X.ptr; X.ptr=tmp_ptr;
+	long tmp_N=d->m_N; d->m_N=X.d->m_N; X.d->m_N=tmp_N;
+	bool tmp_owned=d->m_owned; d->m_owned=X.d->m_owned; X.d->m_owned=tmp_owned;
+}
 
 template <class T> FBArray1D<T>::~FBArray1D()
 {
-	if (ptr) free(ptr);
+	if ((ptr)&&(d->m_owned)) free(ptr);
 	delete d;
 }
 template <class T> void FBArray1D<T>::allocate(long N) {
-	d->m_N=0;
-	if (ptr) free(ptr);
+	clear();
 	if (N==0) {
 		qWarning() << "Allocating array of size zero";
 		ptr=0; return;
 	}	
-	ptr=(T *)malloc(sizeof(T)*N);
+	ptr=(T *)calloc(N,sizeof(T)); //zeros
 	if (ptr) {
 		d->m_N=N;
-		setAll(0);
 	}
 	else {
 		ptr=0;
 		qWarning() << "Error allocating!";
 	}
 }
+template <class T> void FBArray1D<T>::allocate(long N,FBArena *arena) {
+	clear();
+	if (N==0) {
+		qWarning() << "Allocating array of size zero";
+		ptr=0; return;
+	}
+	ptr=(T *)arena->allocate(sizeof(T)*N); //zeros
+	if (ptr) {
+		d->m_N=N;
+		d->m_owned=false;
+	}
+	else {
+		qWarning() << "Error allocating!";
+	}
+}
 template <class T> void FBArray1D<T>::setAll(T val) {
 	for (long i=0; i<d->m_N; i++) ptr[i]=val;
 }
@@ -129,8 +181,20 @@ template <class T> long FBArray1D<T>::length() const {
 	return d->m_N;
 }
 template <class T> void FBArray1D<T>::clear() {
-	if (ptr) free(ptr); ptr=0;
+	if ((ptr)&&(d->m_owned)) free(ptr);
+	ptr=0;
+	d->m_N=0;
+	d->m_owned=true;
 }
+//The data of an FBArray4D, shared by its copies. It is only duplicated (detach) when one of the copies is modified,
+//so passing the arrays around by value (for example into FBBlockSetupParameters) does not copy them.
+template <class TT>
+class FBArray4DData {
+public:
+	QAtomicInt ref;
+	FBArray1D<TT> data;
+};
+
 template <class TT>
 class FBArray4DPrivate {
 public:
@@ -138,7 +202,7 @@ public:
 	long m_N1,m_N2,m_N3,m_N4;
 	long m_N1N2;
 	long m_N1N2N3;
-	FBArray1D<TT> m_data;
+	FBArray4DData<TT> *m_shared;
 	void copy_from(const FBArray4D<TT> &X) {
 		m_N1=X.d->m_N1;
 		m_N2=X.d->m_N2;
@@ -146,7 +210,29 @@ public:
 		m_N4=X.d->m_N4;
 		m_N1N2=X.d->m_N1N2;
 		m_N1N2N3=X.d->m_N1N2N3;
-		m_data=X.d->m_data;
+		if (m_shared==X.d->m_shared) return;
+		X.d->m_shared->ref.ref();
+		release();
+		m_shared=X.d->m_shared;
+	}
+	void release() {
+		if (!m_shared->ref.deref()) delete m_shared;
+		m_shared=0;
+	}
+	void detach() {
+		if (m_shared->ref==1) return;
+		FBArray4DData<TT> *D=new FBArray4DData<TT>;
+		D->ref=1;
+		D->data=m_shared->data;
+		release();
+		m_shared=D;
+	}
+	void initialize() {
+		m_N1=m_N2=m_N3=m_N4=0;
+		m_N1N2=0;
+		m_N1N2N3=0;
+		m_shared=new FBArray4DData<TT>;
+		m_shared->ref=1;
 	}
 };
 
@@ -154,24 +240,35 @@ template <class T> FBArray4D<T>::FBArray4D()
 {
 	d=new FBArray4DPrivate<T>;
 	d->q=this;
-	d->m_N1=d->m_N2=d->m_N3=d->m_N4=0;
-	d->m_N1N2=0;
-	d->m_N1N2N3=0;
+	d->initialize();
 }
 template <class T> FBArray4D<T>::FBArray4D(const FBArray4D &X) {
 	d=new FBArray4DPrivate<T>;
 	d->q=this;
-	d->m_N1=d->m_N2=d->m_N3=d->m_N4=0;
-	d->m_N1N2=0;
-	d->m_N1N2N3=0;
+	d->initialize();
 	d->copy_from(X);
 }
 template <class T> void FBArray4D<T>::operator=(const FBArray4D &X) {
 	d->copy_from(X);
 }
+#ifdef Q_COMPILER_RVALUE_REFS
+template <class T> FBArray4D<T>::FBArray4D(FBArray4D &&X) {
+	d=X.d;
+	d->q=this;
+	X.d=new FBArray4DPrivate<T>;
+	X.d->q=&X;
+	X.d->initialize();
+}
+template <class T> void FBArray4D<T>::operator=(FBArray4D &&X) {
+	FBArray4DPrivate<T> *tmp=d; d=X.d; X.d=tmp;
+	d->q=this;
+	X.d->q=&X;
+}
+#endif
 
 template <class T> FBArray4D<T>::~FBArray4D()
 {
+	d->release();
 	delete d;
 }
 template <class T> void FBArray4D<T>::allocate(long N1,long N2,long N3,long N4) {
@@ -181,18 +278,22 @@ template <class T> void FBArray4D<T>::allocate(long N1,long N2,long N3,long N4)
 	d->m_N4=N4;
 	d->m_N1N2=d->m_N1*d->m_N2;
 	d->m_N1N2N3=d->m_N1*d->m_N2*d->m_N3;
-	d->m_data.allocate(N1*N2*N3*N4);
+	//new data, so there is no need to copy the shared data first
+	d->release();
+	d->m_shared=new FBArray4DData<T>;
+	d->m_shared->ref=1;
+	d->m_shared->data.allocate(N1*N2*N3*N4);
 }
 template <class T> T FBArray4D<T>::value(long i1,long i2,long i3,long i4) const {
 	if ((i1<0)||(i1>=d->m_N1)) return 0;
 	if ((i2<0)||(i2>=d->m_N2)) return 0;
 	if ((i3<0)||(i3>=d->m_N3)) return 0;
 	if ((i4<0)||(i4>=d->m_N4)) return 0;
-	T ret=d->m_data.ptr[i1+d->m_N1*i2+d->m_N1N2*i3+d->m_N1N2N3*i4];
+	T ret=d->m_shared->data.ptr[i1+d->m_N1*i2+d->m_N1N2*i3+d->m_N1N2N3*i4];
 	return ret;
 }
 template <class T> T FBArray4D<T>::value1(long i) const {
-	T ret=d->m_data.ptr[i];
+	T ret=d->m_shared->data.ptr[i];
 	return ret;
 }
 template <class T> void FBArray4D<T>::setValue(T val,long i1,long i2,long i3,long i4) {
@@ -200,20 +301,24 @@ template <class T> void FBArray4D<T>::setValue(T val,long i1,long i2,long i3,lon
 	if ((i2<0)||(i2>=d->m_N2)) return;
 	if ((i3<0)||(i3>=d->m_N3)) return;
 	if ((i4<0)||(i4>=d->m_N4)) return;
-	d->m_data.ptr[i1+d->m_N1*i2+d->m_N1N2*i3+d->m_N1N2N3*i4]=val;
+	d->detach();
+	d->m_shared->data.ptr[i1+d->m_N1*i2+d->m_N1N2*i3+d->m_N1N2N3*i4]=val;
 }
 template <class T> void FBArray4D<T>::incrementValue(T val,long i1,long i2,long i3,long i4) {
 	if ((i1<0)||(i1>=d->m_N1)) return;
 	if ((i2<0)||(i2>=d->m_N2)) return;
 	if ((i3<0)||(i3>=d->m_N3)) return;
 	if ((i4<0)||(i4>=d->m_N4)) return;
-	d->m_data.ptr[i1+d->m_N1*i2+d->m_N1N2*i3+d->m_N1N2N3*i4]+=val;
+	d->detach();
+	d->m_shared->data.ptr[i1+d->m_N1*i2+d->m_N1N2*i3+d->m_N1N2N3*i4]+=val;
 }
 template <class T> void FBArray4D<T>::setValue1(T val,long i) {
-	d->m_data.ptr[i]=val;
+	d->detach();
+	d->m_shared->data.ptr[i]=val;
 }
 template <class T> void FBArray4D<T>::setAll(T val) {
-	d->m_data.setAll(val);
+	d->detach();
+	d->m_shared->data.setAll(val);
 }
 template <class T> long FBArray4D<T>::N1() const {
 	return d->m_N1;
@@ -229,13 +334,11 @@ template <class T> long FBArray4D<T>::N4() const {
 }
 template <class T> void FBArray4D<T>::clear() 
 {
-	d->m_data.clear();
-	d->m_N1=d->m_N2=d->m_N3=d->m_N4=0;
-	d->m_N1N2=0;
-	d->m_N1N2N3=0;
+	d->release();
+	d->initialize();
 }
 template <class T> long FBArray4D<T>::debug_length_of_data() const {
-	return d->m_data.length();
+	return d->m_shared->data.length();
 }
 
 
@@ -0,0 +1,142 @@
+#include "fbarena.h"
+#include <stdlib.h>
+#include <QDebug>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#define ARENA_MIN_CHUNK_SIZE (4*ARENA_HUGE_PAGE_SIZE)
+
+FBArena::FBArena()
+{
+	m_bytes_allocated=0;
+}
+
+FBArena::~FBArena()
+{
+	release();
+}
+
+bool FBArena::add_chunk(long min_size) {
+	long size=qMax(min_size,(long)ARENA_MIN_CHUNK_SIZE);
+	size=((size+ARENA_HUGE_PAGE_SIZE-1)/ARENA_HUGE_PAGE_SIZE)*ARENA_HUGE_PAGE_SIZE;
+	Chunk C;
+	C.data=0;
+	C.size=size;
+	C.used=0;
+	C.mapped=false;
+	C.file_backed=false;
+	C.calloc_ptr=0;
+	if (!m_scratch_directory.isEmpty()) {
+		if (!map_scratch_file(C)) return false;
+		m_chunks << C;
+		return true;
+	}
+#if defined(__linux__) && defined(MAP_ANONYMOUS)
+	//map one extra huge page so that we can trim the region to a huge page boundary
+	long map_size=size+ARENA_HUGE_PAGE_SIZE;
+	void *ptr=mmap(0,map_size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+	if (ptr!=MAP_FAILED) {
+		char *begin=(char *)ptr;
+		char *aligned=(char *)((((size_t)begin)+ARENA_HUGE_PAGE_SIZE-1)/ARENA_HUGE_PAGE_SIZE*ARENA_HUGE_PAGE_SIZE);
+		if (aligned>begin) munmap(begin,aligned-begin);
+		char *end=begin+map_size;
+		if (end>aligned+size) munmap(aligned+size,end-(aligned+size));
+#ifdef MADV_HUGEPAGE
+		madvise(aligned,size,MADV_HUGEPAGE);
+#endif
+		C.data=aligned;
+		C.mapped=true;
+	}
+#endif
+	if (!C.data) {
+		C.calloc_ptr=calloc(size+ARENA_ALIGNMENT,1);
+		if (!C.calloc_ptr) return false;
+		C.data=(char *)((((size_t)C.calloc_ptr)+ARENA_ALIGNMENT-1)/ARENA_ALIGNMENT*ARENA_ALIGNMENT);
+	}
+	m_chunks << C;
+	return true;
+}
+
+bool FBArena::map_scratch_file(Chunk &C) {
+#ifdef __linux__
+	//the file is removed right away, so it disappears with the mapping, even if we crash
+	QByteArray path=(m_scratch_directory+"/fbblock-scratch-XXXXXX").toLocal8Bit();
+	int fd=mkstemp(path.data());
+	if (fd<0) {
+		qWarning() << "Unable to create a scratch file in" << m_scratch_directory;
+		return false;
+	}
+	unlink(path.data());
+	void *ptr=MAP_FAILED;
+	if (ftruncate(fd,C.size)==0) { //a sparse file of zeros
+		ptr=mmap(0,C.size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	}
+	close(fd); //the mapping keeps the file open
+	if (ptr==MAP_FAILED) {
+		qWarning() << "Unable to map a scratch file of size" << C.size << "in" << m_scratch_directory;
+		return false;
+	}
+	C.data=(char *)ptr;
+	C.mapped=true;
+	C.file_backed=true;
+	return true;
+#else
+	Q_UNUSED(C)
+	qWarning() << "Scratch files are not supported on this system.";
+	return false;
+#endif
+}
+
+void *FBArena::allocate(long num_bytes) {
+	if (num_bytes<=0) return 0;
+	num_bytes=((num_bytes+ARENA_ALIGNMENT-1)/ARENA_ALIGNMENT)*ARENA_ALIGNMENT;
+	//only the last chunk has room; a large request that does not fit gets a chunk of its own
+	if ((m_chunks.isEmpty())||(m_chunks.last().used+num_bytes>m_chunks.last().size)) {
+		if (!add_chunk(num_bytes)) {
+			qWarning() << "Unable to allocate arena memory:" << num_bytes;
+			return 0;
+		}
+	}
+	Chunk &C=m_chunks.last();
+	void *ret=C.data+C.used;
+	C.used+=num_bytes;
+	m_bytes_allocated+=num_bytes;
+	return ret;
+}
+
+void FBArena::release() {
+	for (int i=0; i<m_chunks.count(); i++) {
+		Chunk &C=m_chunks[i];
+#if defined(__linux__) && defined(MAP_ANONYMOUS)
+		if (C.mapped) munmap(C.data,C.size);
+#endif
+		if (C.calloc_ptr) free(C.calloc_ptr);
+	}
+	m_chunks.clear();
+	m_bytes_allocated=0;
+}
+
+long FBArena::bytesAllocated() const {
+	return m_bytes_allocated;
+}
+
+void FBArena::setScratchDirectory(const QString &path) {
+	m_scratch_directory=path;
+}
+
+void FBArena::prefetch() const {
+#if defined(__linux__) && defined(MADV_WILLNEED)
+	for (int i=0; i<m_chunks.count(); i++) {
+		const Chunk &C=m_chunks[i];
+		if (C.file_backed) madvise(C.data,C.used,MADV_WILLNEED);
+	}
+#endif
+}
+
+long FBArena::bytesReserved() const {
+	long ret=0;
+	for (int i=0; i<m_chunks.count(); i++) ret+=m_chunks[i].size;
+	return ret;
+}
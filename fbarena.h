@@ -0,0 +1,45 @@
+#ifndef fbarena_H
+#define fbarena_H
+
+#include <QList>
+#include <QString>
+
+#define ARENA_ALIGNMENT 64 //bytes, one cache line
+#define ARENA_HUGE_PAGE_SIZE (2*1024*1024)
+
+//Memory for the arrays of a block, handed out in cache-line aligned pieces and returned all at once with release().
+//The memory comes in chunks of whole 2 MB pages, mapped anonymously and marked for transparent huge pages where
+//the system supports it (otherwise from calloc). Either way the pages are zero and are only touched when first
+//used, so the arrays need no initialization loop.
+//With a scratch directory the chunks are mapped from files there instead, so that the system can write the pages
+//out to disk and read them back as the block is used; this is how blocks larger than the memory are solved.
+class FBArena {
+public:
+	FBArena();
+	virtual ~FBArena();
+	void *allocate(long num_bytes); //zero-initialized; 0 if the memory could not be obtained
+	void release(); //frees all the memory handed out so far
+	long bytesAllocated() const;
+	long bytesReserved() const;
+	void setScratchDirectory(const QString &path); //for the chunks added from now on; empty for anonymous memory
+	void prefetch() const; //asks the system to start reading the file-backed chunks back into memory, without waiting
+private:
+	struct Chunk {
+		char *data;
+		long size;
+		long used;
+		bool mapped; //true if data came from mmap rather than calloc
+		bool file_backed; //true if mapped from a scratch file
+		void *calloc_ptr;
+	};
+	QList<Chunk> m_chunks;
+	long m_bytes_allocated;
+	QString m_scratch_directory;
+	bool map_scratch_file(Chunk &C);
+	bool add_chunk(long min_size);
+	//copies are not allowed
+	FBArena(const FBArena &);
+	void operator=(const FBArena &);
+};
+
+#endif
@@ -6,11 +6,83 @@
 #include "fbtimer.h"
 #include <math.h>
 #include "mda_io.h"
+#include "fbworkerteam.h"
+#include "fbvectorkernels.h"
+#include "fboccupancybitmap.h"
+#include <QMutex>
 
+//8 bytes per element. Along a row of elements, up to the next gap in the vertices, the corner rows (y+1,z), (y,z+1)
+//and (y+1,z+1) are at the same offsets from the row (y,z), so the elements are grouped into segments that share
+//these offsets (FBElementSegment), and an element only stores its segment and the position of its first corner
+//in the segment (see element_ref_indices). The offsets and indices in the segments are full size, for any block.
+//The strains and nonlinear factors are kept in separate arrays, which are only allocated for nonlinear analysis.
 struct FBBlockElement {
-	long ref_indices[4];
+	unsigned int segment; //in m_element_segments
+	unsigned short vertex_offset; //of the corner (x,y,z), in vertices from the first corner of the segment
 	unsigned char bvf;
-	float strain;
+	unsigned char owned_corners; //bit c is set if corner c (variables 3c..3c+2 of the 24) is not on the outer interface
+};
+
+struct FBElementSegment {
+	long ref_index; //first variable of the corner (x,y,z) of the first element of the segment
+	long row_offsets[3]; //in variables, from the corner (x,y,z) to the corners (x,y+1,z), (x,y,z+1) and (x,y+1,z+1)
+};
+
+struct FBVariableSpan {
+	long begin,end; //a run of consecutive variables (one row of vertices)
+};
+
+struct FBElementTile {
+	long begin,boundary_begin,end; //the elements in [begin,boundary_begin) have all corners owned, those in [boundary_begin,end) touch the outer interface
+	long spans_begin,spans_end; //the variable rows read and written by this tile, as a range of m_tile_spans
+	long num_cache_lines; //number of cache lines covered by those rows (per vector)
+	int colour; //parity of the tile position (0-7); tiles of the same colour share no vertices
+};
+
+#define NUM_TILE_COLOURS 8
+#define DEFAULT_THREADED_TILE_SIZE 8 //tile size used for the colouring when several threads work on a block, but no tile size was given
+
+//what FBTileTask does with each tile
+#define TILE_OPERATION_MULTIPLY 1
+#define TILE_OPERATION_DIAGONAL 2
+#define TILE_OPERATION_STRAINS 3
+
+//the sweeps of FBLowMemoryTask
+#define LOW_MEMORY_RESIDUAL 1 //r=-Ax
+#define LOW_MEMORY_PRODUCTS 2 //the step A products, with Ap formed on the fly
+#define LOW_MEMORY_UPDATE 3 //r=r-alpha*Ap, x=x+alpha*p (Ap formed on the fly), then p=beta*p+r/C
+
+#define FLOATS_PER_CACHE_LINE 16
+#define ELEMENTS_PER_PREFETCH_STEP 32
+
+//walks through the variable rows of the next tile, a few cache lines per step, so that the prefetches are spread over the current tile
+struct FBPrefetchCursor {
+	const FBVariableSpan *spans;
+	long num_spans;
+	long span_index;
+	long offset;
+	long lines_per_step;
+	const float *X;
+	const float *Y;
+	long vertex_stride; //of X and Y, see FBBlockVector
+};
+
+#define ALL_CORNERS_OWNED 0xFF
+
+//m_vertex_flags holds one byte per vertex: bit dd is set if direction dd is free, and the vertex type is in bits 3-4
+#define VERTEX_FREE_MASK 0x07
+#define VERTEX_TYPE_SHIFT 3
+#define VERTEX_TYPE_INTERNAL 1
+#define VERTEX_TYPE_INNER_INTERFACE 2
+#define VERTEX_TYPE_OUTER_INTERFACE 3
+
+//One of the CG vectors x, r, p and Ap of the block. With VECTOR_LAYOUT_SPLIT the vector has its own array (vertex_stride=3),
+//with VECTOR_LAYOUT_INTERLEAVED the four vectors share one array and vertex_stride=12.
+struct FBBlockVector {
+	float *ptr;
+	long vertex_stride; //floats from one vertex to the next
+	float &operator[](long varind) const {return ptr[(varind/3)*vertex_stride+varind%3];}
+	float *vertex(long varind) const {return &ptr[(varind/3)*vertex_stride];} //the 3 values of the vertex of variable varind
 };
 
 struct FBVertexLocation {
@@ -22,22 +94,59 @@ class FBBlockPrivate {
 public:
 	FBBlock *q;
 	FBArray2D<float> m_stiffness_matrix; //24x24
+	float m_stiffness_data[24*24]; //row-major copy of m_stiffness_matrix used by the element kernels
 	float m_youngs_modulus; //only for reference when computing the element strains for nonlinear analysis
 	float m_voxel_volume;
 	int m_Nx,m_Ny,m_Nz;
 	long m_num_variables;
-	FBArray1D<float> m_x;
-	FBArray1D<float> m_r;
-	FBArray1D<float> m_p;
-	FBArray1D<float> m_Ap;
-	FBArray1D<unsigned char> m_free;
-	FBArray1D<unsigned char> m_vertex_type; //1 = internal, 2 = inner-interface, 3=outer-interface
-	FBArray1D<float> m_preconditioner;
+	//The arrays of the block come from two arenas: m_arena for those that are only needed during the iterations
+	//(released in clearArrays) and m_result_arena for x, r and the reaction forces (released in clearArrays2)
+	FBArena m_arena;
+	FBArena m_result_arena;
+	int m_vector_layout;
+	FBArray1D<float> m_vector_storage[4]; //x, r, p and Ap, or all four interleaved in the first array
+	FBBlockVector m_x;
+	FBBlockVector m_r;
+	FBBlockVector m_p;
+	FBBlockVector m_Ap;
+	FBArray1D<unsigned char> m_vertex_flags; //free directions and vertex type (1 = internal, 2 = inner-interface, 3=outer-interface), see VERTEX_FREE_MASK
+	bool is_free(long varind) const {return ((m_vertex_flags.ptr[varind/3]>>(varind%3))&1);}
+	int vertex_type(long varind) const {return (m_vertex_flags.ptr[varind/3]>>VERTEX_TYPE_SHIFT);}
+	FBArray1D<float> m_preconditioner; //diagonal of A on the owned free variables, 1 elsewhere (so we can always divide)
+	//The fixed variables of the owned vertices are kept out of r and Ap: after every multiplication their values are
+	//moved to these compact arrays, so r, p and Ap are zero on all fixed and outer-interface variables and the
+	//inner products over the owned free variables are plain loops over the whole vectors.
+	QVector<FBVertexLocation> m_fixed_variables; //sorted by ref_index (the variable index, so the direction is ref_index%3)
+	FBArray1D<float> m_r_fixed; //r on m_fixed_variables (the reaction forces)
+	FBArray1D<float> m_Ap_fixed; //Ap on m_fixed_variables
+	//The stress is accumulated from the first moments of r while step B updates it, see stress_from_moments
+	bool m_stress_from_reactions; //only the moments of m_r_fixed
+	FBArray1D<float> m_lever_arms; //3 per variable: the position of its vertex (only when the moments of r are taken from the vectors)
+	FBArray1D<float> m_fixed_lever_arms; //3 per fixed variable
+	//With m_eliminate_fixed, m_r_fixed is not updated in step B, only its moments m_fixed_moments, which change by
+	//-alpha times the products of p with the columns of m_reaction_coefficients (see setup_reaction_moments)
+	bool m_eliminate_fixed;
+	bool fixed_eliminated() const {return ((m_eliminate_fixed)&&(!m_nonlinear_adjuster));} //in nonlinear analysis step A recomputes the reactions anyway
+	bool m_reactions_current; //false if m_r_fixed is behind x
+	double m_fixed_moments[9];
+	double m_fixed_moment_changes[9]; //from step A, for step B
+	QVector<long> m_reaction_vertices; //the vertices next to a fixed variable
+	QVector<float> m_reaction_coefficients; //27 per vertex of m_reaction_vertices: the 9 moment coefficients of each direction
+	long m_num_owned_variables;
 	bool m_use_precondioner;
-	QVector<FBBlockElement> m_elements;
+	FBArray1D<FBBlockElement> m_elements; //grouped into tiles, see m_tiles
+	FBArray1D<FBElementSegment> m_element_segments; //see FBBlockElement
+	QVector<float> m_element_strains; //nonlinear analysis only
+	QVector<float> m_element_factors; //bvf/100, times the nonlinear adjustment of the current strain (nonlinear analysis only)
+	QVector<FBElementTile> m_tiles; //a single tile when the traversal is not tiled
+	QVector<FBVariableSpan> m_tile_spans;
+	int m_tile_size; //0 if the traversal is not tiled
+	QVector<int> m_colour_tiles[NUM_TILE_COLOURS]; //indices of the tiles of each colour
+	FBWorkerTeam m_team; //threads working inside this block
 	QVector<FBVertexLocation> m_outer_vertex_locations; 
+	bool m_low_memory; //see FBBlockSetupParameters::low_memory; no Ap, preconditioner, elements or tiles
 	QVector<FBVertexLocation> m_inner_vertex_locations;
-	FBArray3D<long> m_variable_indices;
+	FBOccupancyBitmap m_vertices; //(Nx+2)x(Ny+2)x(Nz+2), the vertices of the block numbered in the order of the variables
 	FBArray3D<unsigned char> m_bvf_map;
 	float m_resolution[3];
 	int m_block_x_position;
@@ -46,12 +155,64 @@ public:
 	QString m_block_id;
 	NonlinearAdjuster *m_nonlinear_adjuster;
 	
-	double inner_product_on_owned_free_variables(const FBArray1D<float> &V1,const FBArray1D<float> &V2);
-	double inner_product_on_owned_free_variables(const FBArray1D<float> &V1,const FBArray1D<float> &V2,const FBArray1D<float> &V3);
-	double inner_product_on_owned_fixed_variables(const FBArray1D<float> &V1,const FBArray1D<float> &V2);
-	void multiply_by_A(FBArray1D<float> &Y,const FBArray1D<float> &X); //Y=AX
-	void compute_preconditioner(const FBArray1D<float> &X,FBArray1D<float> &C);
+	//assembled operator (3x3-block sparse rows, one block row per vertex)
+	bool m_operator_assembled;
+	FBArray1D<long> m_bsr_row_starts; //(num_vertices+1) offsets into m_bsr_columns
+	FBArray1D<int> m_bsr_columns; //vertex index of each 3x3 block
+	FBArray1D<float> m_bsr_values; //9 values per 3x3 block, row major
+	
+	//Kernels specialized at compile time, so that the inner loops do not test the nonlinear adjuster,
+	//the preconditioner or the vertex type. select_kernels() picks the variants once.
+	typedef void (FBBlockPrivate::*ElementKernel)(FBBlockVector &Y,const FBBlockVector &X,long begin,long end);
+	typedef void (FBBlockPrivate::*DiagonalKernel)(FBBlockVector &C,long begin,long end);
+	ElementKernel m_multiply_interior_kernel;
+	ElementKernel m_multiply_boundary_kernel;
+	DiagonalKernel m_diagonal_interior_kernel;
+	DiagonalKernel m_diagonal_boundary_kernel;
+	void select_kernels();
+	template <bool NONLINEAR,bool BOUNDARY,bool INTERLEAVED> void multiply_elements_by_A(FBBlockVector &Y,const FBBlockVector &X,long begin,long end);
+	template <bool NONLINEAR,bool BOUNDARY> void add_element_diagonals(FBBlockVector &C,long begin,long end);
+	void compute_step_A_products(FBStepAProducts &ret);
+	double update_x_r_p(double alpha,double beta,double *moments); //returns r_r; adds the first moments of the updated r to moments (if not 0)
+	void setup_lever_arms();
+	void setup_reaction_moments();
+	void update_element_factors();
+	void setup_elements(FBBlockSetupParameters &P);
+	void compress_elements(const QVector<FBBlockElement> &elements,const QVector<long> &ref_indices); //allocates m_elements
+	inline void element_ref_indices(long i,long ref_indices[4]) const;
+	void start_prefetch(FBPrefetchCursor &C,int tile_index,const FBBlockVector *X,const FBBlockVector *Y);
+	void prefetch_vertex_row(int x1,int x2,int yy,int zz);
+	void process_tile(int operation,int tile_index,FBBlockVector *Y,const FBBlockVector *X);
+	void run_on_tiles(int operation,FBBlockVector *Y,const FBBlockVector *X);
+	void compute_element_strains(long begin,long end);
+	double compute_element_energy(const long ref_indices[4],unsigned char bvf);
+	
+	void allocate_vectors();
+	void set_to_zero(FBBlockVector &V);
+	double inner_product_on_owned_free_variables(const FBBlockVector &V1,const FBBlockVector &V2);
+	void move_fixed_values(FBBlockVector &V,FBArray1D<float> &V_fixed); //V_fixed = V on the fixed variables, then zero there
+	void zero_fixed_values(FBBlockVector &V);
+	void initialize_residual();
+	long fixed_variable_position(long varind);
+	long variable_index(long xx,long yy,long zz) const {long vv=m_vertices.index(xx,yy,zz); return (vv>=0) ? vv*3 : -1;} //of the first direction; -1 if there is no vertex
+	void multiply_by_A(FBBlockVector &Y,const FBBlockVector &X); //Y=AX
+	void multiply_by_assembled_A(FBBlockVector &Y,const FBBlockVector &X); //Y=AX using the BSR matrix
+	bool assemble_operator(int operator_mode,double memory_budget);
+	long vertex_coupling_mask(int xx,int yy,int zz) const; //the neighbors of an owned vertex that have a block in its BSR row
+	void compute_preconditioner(FBArray1D<float> &C);
 	QList<double> compute_stress();
+	
+	//low-memory mode: the rows of AX are formed vertex by vertex from the elements around each vertex,
+	//going through the planes zz=1..Nz of owned vertices (a contiguous range of planes per thread)
+	void vertex_product(int xx,int yy,int zz,const FBBlockVector &X,float Y[3]); //Y = AX at the owned vertex (xx,yy,zz)
+	void vertex_preconditioner(int xx,int yy,int zz,long vv,float C[3]); //the values of m_preconditioner at vertex vv
+	void plane_range(int thread_index,int num_threads,int &z0,int &z1) const; //z0>z1 if the thread has no planes
+	bool plane_is_deferred(int zz,int z0,int z1) const;
+	void low_memory_residual(int zz);
+	void low_memory_products(int zz,FBStepAProducts &ret);
+	void low_memory_update_r_x(int zz,double alpha);
+	double low_memory_update_p(int zz,double beta,double *moments); //returns r_r on the plane
+	void run_low_memory_sweep(int operation,double alpha,double beta,FBStepAProducts *products,double *r_r,double *moments);
 };
 
 FBBlock::FBBlock(int block_num) 
@@ -64,6 +225,18 @@ FBBlock::FBBlock(int block_num)
 	d->m_nonlinear_adjuster=0;
 	d->m_youngs_modulus=1;
 	d->m_voxel_volume=1;
+	d->m_operator_assembled=false;
+	d->m_num_owned_variables=0;
+	d->m_tile_size=0;
+	d->m_vector_layout=VECTOR_LAYOUT_SPLIT;
+	d->m_low_memory=false;
+	d->m_stress_from_reactions=false;
+	d->m_eliminate_fixed=false;
+	d->m_reactions_current=true;
+	for (int kk=0; kk<9; kk++) d->m_fixed_moments[kk]=d->m_fixed_moment_changes[kk]=0;
+	d->allocate_vectors();
+	for (int i=0; i<24*24; i++) d->m_stiffness_data[i]=0;
+	d->select_kernels();
 	d->m_block_id=QString("block%1").arg(block_num);
 	block_num++;
 	for (int i=0; i<3; i++) d->m_resolution[i]=1;
@@ -86,51 +259,79 @@ void check_for_nan(QString str,FBArray1D<float> &X) {
 	}
 }
 
+//Returns the rows (yy,zz) of an Ny x Nz grid of rows, encoded as yy+Ny*zz, in the order in which setup() numbers them
+QVector<long> get_row_order(int ordering,int Ny,int Nz) {
+	QVector<long> ret;
+	if (ordering==VARIABLE_ORDERING_MORTON) {
+		//interleave the bits of yy (even) and zz (odd), skipping the codes that fall outside the grid
+		int num_bits=0;
+		while (((1<<num_bits)<Ny)||((1<<num_bits)<Nz)) num_bits++;
+		long num_codes=((long)1)<<(2*num_bits);
+		for (long code=0; code<num_codes; code++) {
+			long yy=0,zz=0;
+			for (int bb=0; bb<num_bits; bb++) {
+				yy|=((code>>(2*bb))&1)<<bb;
+				zz|=((code>>(2*bb+1))&1)<<bb;
+			}
+			if ((yy<Ny)&&(zz<Nz)) ret << yy+Ny*zz;
+		}
+	}
+	else {
+		for (long zz=0; zz<Nz; zz++)
+		for (long yy=0; yy<Ny; yy++)
+			ret << yy+Ny*zz;
+	}
+	return ret;
+}
+
+bool fixed_variable_less_than(const FBVertexLocation &VL1,const FBVertexLocation &VL2) {
+	return (VL1.ref_index<VL2.ref_index);
+}
+
 void FBBlock::setup(FBBlockSetupParameters &P) {
+	clearArrays();
+	clearArrays2();
+	d->m_arena.setScratchDirectory(P.scratch_directory);
+	d->m_result_arena.setScratchDirectory(P.scratch_directory);
 	d->m_bvf_map=P.BVF;
+	d->m_fixed_variables.clear();
+	d->m_num_owned_variables=0;
 	
 	//set the stiffness_matrix and Nx,Ny,Nz
 	d->m_stiffness_matrix=P.stiffness_matrix;
+	for (int rr=0; rr<24; rr++)
+	for (int cc=0; cc<24; cc++) {
+		d->m_stiffness_data[rr*24+cc]=d->m_stiffness_matrix.value(rr,cc);
+	}
 	d->m_youngs_modulus=P.youngs_modulus;
 	d->m_voxel_volume=P.voxel_volume;
 	d->m_Nx=P.Nx;
 	d->m_Ny=P.Ny;
 	d->m_Nz=P.Nz;
 	d->m_use_precondioner=P.use_preconditioner;
+	d->m_low_memory=P.low_memory;
+	d->m_stress_from_reactions=P.stress_from_reactions;
+	d->m_eliminate_fixed=((P.eliminate_fixed_variables)&&(!P.low_memory));
+	d->m_reactions_current=true;
+	d->m_reaction_vertices.clear();
+	d->m_reaction_coefficients.clear();
+	d->m_vector_layout=P.low_memory ? VECTOR_LAYOUT_SPLIT : P.vector_layout;
+	d->select_kernels(); //the layout is needed by the kernels already in initialize_residual and compute_preconditioner
+	d->m_team.setThreadCount(P.num_threads);
 	for (int i=0; i<3; i++) d->m_resolution[i]=P.resolution[i];
 	d->m_block_x_position=P.block_x_position;
 	d->m_block_y_position=P.block_y_position;
 	d->m_block_z_position=P.block_z_position;
 	
 	//determine which vertices are needed
-	FBArray3D<unsigned char> vertex_occupancy; 
-	vertex_occupancy.allocate(P.Nx+2,P.Ny+2,P.Nz+2);
-	for (int zz=0; zz<P.Nz+1; zz++)
-	for (int yy=0; yy<P.Ny+1; yy++)
-	for (int xx=0; xx<P.Nx+1; xx++) {
-		if (P.BVF.value(xx,yy,zz)) {
-			for (int dzz=0; dzz<=1; dzz++)
-			for (int dyy=0; dyy<=1; dyy++)
-			for (int dxx=0; dxx<=1; dxx++) {
-				vertex_occupancy.setValue(1,xx+dxx,yy+dyy,zz+dzz);
-			}
-		}
-	}
+	FBOccupancyBitmap &vertex_occupancy=d->m_vertices;
+	vertex_occupancy.setFromElements(P.BVF); //(Nx+2)x(Ny+2)x(Nz+2)
 
-	//assign the variable indices
-	d->m_num_variables=0;
-	d->m_variable_indices.allocate(P.Nx+2,P.Ny+2,P.Nz+2);
-	d->m_variable_indices.setAll(-1);
-	for (int zz=0; zz<P.Nz+2; zz++)
-	for (int yy=0; yy<P.Ny+2; yy++)
-	for (int xx=0; xx<P.Nx+2; xx++) {
-		if (vertex_occupancy.value(xx,yy,zz)) {
-			d->m_variable_indices.setValue(d->m_num_variables,xx,yy,zz);
-			d->m_num_variables+=3; //each vertex contains 3 directions
-		}
-	}
+	//assign the variable indices, row by row, so that the x-neighbor of a vertex is always 3 variables further
+	QVector<long> vertex_rows=get_row_order(P.variable_ordering,P.Ny+2,P.Nz+2);
+	d->m_num_variables=vertex_occupancy.assignIndices(vertex_rows)*3; //each vertex contains 3 directions
 	
-	//allocate the vectors, and define m_free and m_vertex_type vectors, and initialize m_x.
+	//allocate the vectors, and define the m_vertex_flags, and initialize m_x.
 	//Also, set up m_outer_vertex_locations and m_inner_vertex_locations
 	
 	if (!d->m_num_variables) {
@@ -138,25 +339,22 @@ void FBBlock::setup(FBBlockSetupParameters &P) {
 		return; //when there is no bvf on the whole block
 	}
 	
-	d->m_x.allocate(d->m_num_variables);
-	d->m_r.allocate(d->m_num_variables);
-	d->m_p.allocate(d->m_num_variables);
-	d->m_Ap.allocate(d->m_num_variables);
-	d->m_free.allocate(d->m_num_variables);
-	d->m_vertex_type.allocate(d->m_num_variables);	
+	d->allocate_vectors();
+	d->m_vertex_flags.allocate(d->m_num_variables/3,&d->m_arena);
 	for (int zz=0; zz<P.Nz+2; zz++)
 	for (int yy=0; yy<P.Ny+2; yy++)
 	for (int xx=0; xx<P.Nx+2; xx++) {
-		if (vertex_occupancy.value(xx,yy,zz)) {
+		if (vertex_occupancy.isOccupied(xx,yy,zz)) {
 			for (int dd=0; dd<3; dd++) {
-				long varind=d->m_variable_indices.value(xx,yy,zz)+dd;
+				long varind=d->variable_index(xx,yy,zz)+dd;
 				if (varind>=0) {
-					if (!P.fixed.value(xx,yy,zz,dd)) d->m_free.ptr[varind]=1;
+					unsigned char *flags=&d->m_vertex_flags.ptr[varind/3];
+					if (!P.fixed.value(xx,yy,zz,dd)) *flags|=(1<<dd);
 					if ((xx>=2)&&(xx<=P.Nx-1)&&(yy>=2)&&(yy<=P.Ny-1)&&(zz>=2)&&(zz<=P.Nz-1)) {
-						d->m_vertex_type.ptr[varind]=1; //internal vertex
+						if (dd==0) *flags|=(VERTEX_TYPE_INTERNAL<<VERTEX_TYPE_SHIFT); //internal vertex
 					}
 					else if ((xx>=1)&&(xx<=P.Nx)&&(yy>=1)&&(yy<=P.Ny)&&(zz>=1)&&(zz<=P.Nz)) {
-						d->m_vertex_type.ptr[varind]=2; //inner interface vertex
+						if (dd==0) *flags|=(VERTEX_TYPE_INNER_INTERFACE<<VERTEX_TYPE_SHIFT); //inner interface vertex
 						if (dd==0) {
 							FBVertexLocation VL;
 							VL.x=xx;
@@ -167,7 +365,7 @@ void FBBlock::setup(FBBlockSetupParameters &P) {
 						}
 					}
 					else {
-						d->m_vertex_type.ptr[varind]=3; //outer interface vertex
+						if (dd==0) *flags|=(VERTEX_TYPE_OUTER_INTERFACE<<VERTEX_TYPE_SHIFT); //outer interface vertex
 						if (dd==0) {
 							FBVertexLocation VL;
 							VL.x=xx;
@@ -177,48 +375,65 @@ void FBBlock::setup(FBBlockSetupParameters &P) {
 							d->m_outer_vertex_locations << VL;
 						}
 					}
-					d->m_x.ptr[varind]=P.X0.value(xx,yy,zz,dd);
+					if (d->vertex_type(varind)!=VERTEX_TYPE_OUTER_INTERFACE) {
+						d->m_num_owned_variables++;
+						if (!d->is_free(varind)) {
+							FBVertexLocation VL;
+							VL.x=xx;
+							VL.y=yy;
+							VL.z=zz;
+							VL.ref_index=varind;
+							d->m_fixed_variables << VL;
+						}
+					}
+					d->m_x[varind]=P.X0.value(xx,yy,zz,dd);
 				}
 			}
 		}
 	}
 	
-	//set up the FBBlockElement list
-	for (int zz=0; zz<P.Nz+1; zz++)
-	for (int yy=0; yy<P.Ny+1; yy++)
-	for (int xx=0; xx<P.Nx+1; xx++) {
-		if (P.BVF.value(xx,yy,zz)) {
-			FBBlockElement E0;
-			E0.bvf=P.BVF.value(xx,yy,zz);
-			E0.strain=0;
-			E0.ref_indices[0]=(long)d->m_variable_indices.value(xx,yy,zz);
-			E0.ref_indices[1]=(long)d->m_variable_indices.value(xx,yy+1,zz);
-			E0.ref_indices[2]=(long)d->m_variable_indices.value(xx,yy,zz+1);
-			E0.ref_indices[3]=(long)d->m_variable_indices.value(xx,yy+1,zz+1);
-			d->m_elements << E0;
-		}
+	if (d->m_low_memory) {
+		//the elements are read from m_bvf_map as they are needed; the tile size is still used by computeEnergyMap
+		d->m_tile_size=P.tile_size;
 	}
-	
-	//initialize r = -Ax (note that x is defined even on the fixed variables, so we don't need b)
-	d->multiply_by_A(d->m_r,d->m_x); //r=Ax
-	for (long ii=0; ii<d->m_num_variables; ii++) {
-		d->m_r.ptr[ii]*=-1; //multiply r by -1: r = -Ax
+	else {
+		d->setup_elements(P);
+		d->update_element_factors();
+		
+		//optionally assemble the local operator, so that multiply_by_A no longer needs the element products
+		d->assemble_operator(P.operator_mode,P.operator_memory_budget);
 	}
+	
+	qSort(d->m_fixed_variables.begin(),d->m_fixed_variables.end(),fixed_variable_less_than);
+	d->m_r_fixed.allocate(qMax(d->m_fixed_variables.count(),1),&d->m_result_arena);
+	if (!d->m_low_memory) d->m_Ap_fixed.allocate(qMax(d->m_fixed_variables.count(),1),&d->m_result_arena);
+	
+	d->initialize_residual();
 	//r is not defined on the outer interface; zeros there
 	P.rnorm2=d->inner_product_on_owned_free_variables(d->m_r,d->m_r); // to compare with bnorm2 as the reference norm
 	
-	if (d->m_use_precondioner) {
-		d->m_preconditioner.allocate(d->m_num_variables);	
-		d->compute_preconditioner(d->m_x,d->m_preconditioner);
+	if ((d->m_use_precondioner)&&(!d->m_low_memory)) {
+		d->m_preconditioner.allocate(d->m_num_variables,&d->m_arena);
+		d->compute_preconditioner(d->m_preconditioner);
+		for (long ii=0; ii<d->m_num_variables; ii++) {
+			if (!d->m_preconditioner.ptr[ii]) d->m_preconditioner.ptr[ii]=1;
+		}
 	}
+	d->setup_lever_arms();
+	if (d->m_eliminate_fixed) d->setup_reaction_moments();
 	
 	//define p equal to r on the free variables only; zeros everywhere else
-	for (long ii=0; ii<d->m_num_variables; ii++) {
-		if (d->m_free.ptr[ii]) {
-			if ((d->m_use_precondioner)&&(d->m_preconditioner.ptr[ii])) {
-				d->m_p.ptr[ii]=d->m_r.ptr[ii]/d->m_preconditioner.ptr[ii];
-			}
-			else d->m_p.ptr[ii]=d->m_r.ptr[ii];
+	if (d->m_low_memory) {
+		for (int zz=1; zz<=d->m_Nz; zz++) d->low_memory_update_p(zz,0,0); //p is still zero, so this sets p=r/C
+	}
+	else for (long vv=0; vv<d->m_num_variables/3; vv++) {
+		int free_mask=d->m_vertex_flags.ptr[vv]&VERTEX_FREE_MASK;
+		float *P0=d->m_p.vertex(vv*3);
+		const float *R0=d->m_r.vertex(vv*3);
+		for (int dd=0; dd<3; dd++) {
+			float val=R0[dd];
+			if (d->m_use_precondioner) val/=d->m_preconditioner.ptr[vv*3+dd];
+			P0[dd]=((free_mask>>dd)&1) ? val : 0;
 		}
 	}
 	//here, p is not defined on outer interface
@@ -230,10 +445,10 @@ void FBBlock::setup(FBBlockSetupParameters &P) {
 		FBVertexLocation *VL=&d->m_inner_vertex_locations[ii];
 		for (int dd=0; dd<3; dd++) {
 			long varind=VL->ref_index+dd;
-			if (d->m_free.ptr[varind]) {
+			if (d->is_free(varind)) {
 				if (pass<=2) P.p_on_inner_interface.setupIndex(pass,dd,VL->x,VL->y,VL->z);
 				else if (pass==3) {
-					P.p_on_inner_interface.setValue(d->m_p.ptr[varind],dd,VL->x,VL->y,VL->z);
+					P.p_on_inner_interface.setValue(d->m_p[varind],dd,VL->x,VL->y,VL->z);
 				}
 			}
 		}
@@ -244,41 +459,324 @@ void FBBlock::setup(FBBlockSetupParameters &P) {
 		FBVertexLocation *VL=&d->m_inner_vertex_locations[ii];
 		for (int dd=0; dd<3; dd++) {
 			long varind=VL->ref_index+dd;
-			if (d->m_free.ptr[varind]) {
-				if (VL->z==1) P.p_on_top_inner_interface.setValue(d->m_p.ptr[varind],dd,VL->x-1,VL->y-1);
-				else if (VL->z==d->m_Nz) P.p_on_bottom_inner_interface.setValue(d->m_p.ptr[varind],dd,VL->x-1,VL->y-1);
+			if (d->is_free(varind)) {
+				if (VL->z==1) P.p_on_top_inner_interface.setValue(d->m_p[varind],dd,VL->x-1,VL->y-1);
+				else if (VL->z==d->m_Nz) P.p_on_bottom_inner_interface.setValue(d->m_p[varind],dd,VL->x-1,VL->y-1);
+			}
+		}
+	}
+}
+void FBBlockPrivate::setup_elements(FBBlockSetupParameters &P) {
+	//Set up the FBBlockElement list, grouped into tiles of tile_size^3 elements (or a single tile).
+	//Within a tile the elements are visited in the same row order as the vertices,
+	//and the elements that touch the outer interface are moved to the end of the tile.
+	//When several threads work on the block, the tiles are also needed for the colouring.
+	m_tile_size=P.tile_size;
+	if ((m_tile_size<=0)&&(m_team.threadCount()>1)) m_tile_size=DEFAULT_THREADED_TILE_SIZE;
+	int tile_size[3];
+	tile_size[0]=P.Nx+1; tile_size[1]=P.Ny+1; tile_size[2]=P.Nz+1;
+	if (m_tile_size>0) {
+		for (int i=0; i<3; i++) tile_size[i]=qMin(tile_size[i],m_tile_size);
+	}
+	QVector<FBBlockElement> elements;
+	QVector<long> all_ref_indices;
+	for (int tz=0; tz<P.Nz+1; tz+=tile_size[2])
+	for (int ty=0; ty<P.Ny+1; ty+=tile_size[1])
+	for (int tx=0; tx<P.Nx+1; tx+=tile_size[0]) {
+		int nx=qMin(tile_size[0],P.Nx+1-tx);
+		int ny=qMin(tile_size[1],P.Ny+1-ty);
+		int nz=qMin(tile_size[2],P.Nz+1-tz);
+		FBElementTile T;
+		T.begin=elements.count();
+		QVector<FBBlockElement> boundary_elements;
+		QVector<long> boundary_ref_indices;
+		QVector<long> element_rows=get_row_order(P.variable_ordering,ny,nz);
+		for (long ii=0; ii<element_rows.count(); ii++)
+		for (int xx=tx; xx<tx+nx; xx++) {
+			int yy=ty+element_rows[ii]%ny;
+			int zz=tz+element_rows[ii]/ny;
+			if (P.BVF.value(xx,yy,zz)) {
+				FBBlockElement E0;
+				E0.bvf=P.BVF.value(xx,yy,zz);
+				long ref_indices[4];
+				ref_indices[0]=variable_index(xx,yy,zz);
+				ref_indices[1]=variable_index(xx,yy+1,zz);
+				ref_indices[2]=variable_index(xx,yy,zz+1);
+				ref_indices[3]=variable_index(xx,yy+1,zz+1);
+				E0.owned_corners=0;
+				for (int cc=0; cc<8; cc++) {
+					if (vertex_type(ref_indices[cc/2]+(cc%2)*3)!=VERTEX_TYPE_OUTER_INTERFACE) E0.owned_corners|=(1<<cc);
+				}
+				//the indices are packed in compress_elements, once we know whether they fit
+				if (E0.owned_corners==ALL_CORNERS_OWNED) {
+					elements << E0;
+					for (int kk=0; kk<4; kk++) all_ref_indices << ref_indices[kk];
+				}
+				else {
+					boundary_elements << E0;
+					for (int kk=0; kk<4; kk++) boundary_ref_indices << ref_indices[kk];
+				}
+			}
+		}
+		T.boundary_begin=elements.count();
+		elements+=boundary_elements;
+		all_ref_indices+=boundary_ref_indices;
+		T.end=elements.count();
+		if (T.end==T.begin) continue;
+		
+		//the vertex rows touched by the tile, for prefetching
+		T.spans_begin=m_tile_spans.count();
+		T.num_cache_lines=0;
+		for (int zz=tz; zz<=tz+nz; zz++)
+		for (int yy=ty; yy<=ty+ny; yy++) {
+			FBVariableSpan S;
+			S.begin=-1; S.end=-1;
+			for (int xx=tx; xx<=tx+nx; xx++) {
+				long varind=variable_index(xx,yy,zz);
+				if (varind>=0) {
+					if (S.begin<0) S.begin=varind;
+					S.end=varind+3;
+				}
+			}
+			if (S.begin>=0) {
+				m_tile_spans << S;
+				T.num_cache_lines+=(S.end-S.begin+FLOATS_PER_CACHE_LINE-1)/FLOATS_PER_CACHE_LINE;
+			}
+		}
+		T.spans_end=m_tile_spans.count();
+		T.colour=((tx/tile_size[0])%2)+2*((ty/tile_size[1])%2)+4*((tz/tile_size[2])%2);
+		m_colour_tiles[T.colour] << m_tiles.count();
+		m_tiles << T;
+	}
+	compress_elements(elements,all_ref_indices);
+}
+
+void FBBlockPrivate::compress_elements(const QVector<FBBlockElement> &elements,const QVector<long> &ref_indices) {
+	//An element joins the current segment if it has the same row offsets and its first corner is at most 0xFFFF vertices
+	//after the start of the segment; otherwise it starts a new one. There are at most as many segments as elements.
+	m_elements.clear();
+	m_element_segments.clear();
+	if (elements.isEmpty()) return;
+	QVector<FBElementSegment> segments;
+	m_elements.allocate(elements.count(),&m_arena);
+	if (!m_elements.ptr) return;
+	memcpy(m_elements.ptr,elements.constData(),elements.count()*sizeof(FBBlockElement));
+	for (long i=0; i<m_elements.length(); i++) {
+		const long *R=&ref_indices[i*4];
+		bool same_segment=false;
+		if (!segments.isEmpty()) {
+			const FBElementSegment *S=&segments[segments.count()-1];
+			same_segment=((R[0]>=S->ref_index)&&((R[0]-S->ref_index)/3<=0xFFFF));
+			for (int kk=0; kk<3; kk++) {
+				if (R[kk+1]-R[0]!=S->row_offsets[kk]) same_segment=false;
 			}
 		}
+		if (!same_segment) {
+			FBElementSegment S;
+			S.ref_index=R[0];
+			for (int kk=0; kk<3; kk++) S.row_offsets[kk]=R[kk+1]-R[0];
+			segments << S;
+		}
+		m_elements.ptr[i].segment=(unsigned int)(segments.count()-1);
+		m_elements.ptr[i].vertex_offset=(unsigned short)((R[0]-segments[segments.count()-1].ref_index)/3);
+	}
+	m_element_segments.allocate(segments.count(),&m_arena);
+	if (m_element_segments.ptr) memcpy(m_element_segments.ptr,segments.constData(),segments.count()*sizeof(FBElementSegment));
+}
+
+inline void FBBlockPrivate::element_ref_indices(long i,long ref_indices[4]) const {
+	const FBBlockElement *E0=&m_elements.ptr[i];
+	const FBElementSegment *S=&m_element_segments.ptr[E0->segment];
+	ref_indices[0]=S->ref_index+3*(long)E0->vertex_offset;
+	for (int kk=0; kk<3; kk++) ref_indices[kk+1]=ref_indices[0]+S->row_offsets[kk];
+}
+
+//Runs one operation over all tiles on the threads of the block. Tiles of one colour never share a vertex,
+//so the scatter into Y needs no locking as long as the colours are processed one after another.
+class FBTileTask : public FBWorkerTask {
+public:
+	FBBlockPrivate *block;
+	int operation;
+	const QVector<int> *tiles;
+	FBBlockVector *Y;
+	const FBBlockVector *X;
+	QAtomicInt next_tile;
+	void run(int thread_index) {
+		Q_UNUSED(thread_index)
+		while (true) {
+			int kk=next_tile.fetchAndAddOrdered(1);
+			if (kk>=tiles->count()) return;
+			block->process_tile(operation,(*tiles)[kk],Y,X);
+		}
+	}
+};
+
+void FBBlockPrivate::process_tile(int operation,int tile_index,FBBlockVector *Y,const FBBlockVector *X) {
+	const FBElementTile *T=&m_tiles[tile_index];
+	if (operation==TILE_OPERATION_MULTIPLY) {
+		(this->*m_multiply_interior_kernel)(*Y,*X,T->begin,T->boundary_begin);
+		(this->*m_multiply_boundary_kernel)(*Y,*X,T->boundary_begin,T->end);
+	}
+	else if (operation==TILE_OPERATION_DIAGONAL) {
+		(this->*m_diagonal_interior_kernel)(*Y,T->begin,T->boundary_begin);
+		(this->*m_diagonal_boundary_kernel)(*Y,T->boundary_begin,T->end);
+	}
+	else if (operation==TILE_OPERATION_STRAINS) {
+		compute_element_strains(T->begin,T->end);
 	}
 }
+
+void FBBlockPrivate::run_on_tiles(int operation,FBBlockVector *Y,const FBBlockVector *X) {
+	if (operation==TILE_OPERATION_STRAINS) {
+		//each element only writes its own strain, so all tiles can go at once
+		QVector<int> all_tiles;
+		for (int tt=0; tt<m_tiles.count(); tt++) all_tiles << tt;
+		FBTileTask task;
+		task.block=this; task.operation=operation; task.tiles=&all_tiles; task.Y=Y; task.X=X; task.next_tile=0;
+		m_team.run(&task);
+		return;
+	}
+	for (int cc=0; cc<NUM_TILE_COLOURS; cc++) {
+		if (m_colour_tiles[cc].isEmpty()) continue;
+		FBTileTask task;
+		task.block=this; task.operation=operation; task.tiles=&m_colour_tiles[cc]; task.Y=Y; task.X=X; task.next_tile=0;
+		m_team.run(&task);
+	}
+}
+
+void FBBlockPrivate::compute_element_strains(long begin,long end) {
+	for (long i=begin; i<end; i++) {
+		const FBBlockElement *E0=&m_elements.ptr[i];
+		long ref_indices[4];
+		element_ref_indices(i,ref_indices);
+		float energy0=compute_element_energy(ref_indices,E0->bvf);
+		float bvf_factor=E0->bvf*1.0/100;
+		float YM=m_youngs_modulus;
+		float voxel_volume=m_voxel_volume;
+		m_element_strains[i]=sqrt(2*qAbs(energy0)/(voxel_volume*YM*bvf_factor));
+	}
+}
+
+void FBBlockPrivate::start_prefetch(FBPrefetchCursor &C,int tile_index,const FBBlockVector *X,const FBBlockVector *Y) {
+	C.spans=0; C.num_spans=0; C.span_index=0; C.offset=0; C.lines_per_step=0;
+	C.X=X->ptr; C.Y=0; C.vertex_stride=X->vertex_stride;
+	//with the interleaved layout Y shares the cache lines of X
+	if ((Y)&&(Y->vertex_stride==3)) C.Y=Y->ptr;
+	if ((tile_index<=0)||(tile_index>=m_tiles.count())) return; //nothing to prefetch for the first tile
+	const FBElementTile *T=&m_tiles[tile_index];
+	const FBElementTile *T0=&m_tiles[tile_index-1]; //the tile that is being processed in the meantime
+	long num_steps=(T0->end-T0->begin+ELEMENTS_PER_PREFETCH_STEP-1)/ELEMENTS_PER_PREFETCH_STEP+1;
+	C.spans=&m_tile_spans.constData()[T->spans_begin];
+	C.num_spans=T->spans_end-T->spans_begin;
+	C.lines_per_step=(T->num_cache_lines*(C.vertex_stride/3)+num_steps-1)/num_steps;
+}
+
+void FBBlockPrivate::prefetch_vertex_row(int x1,int x2,int yy,int zz) {
+	//prefetches the displacements of the vertices x1<=xx<=x2 of the row (yy,zz)
+	long begin=-1,end=-1;
+	for (int xx=x1; xx<=x2; xx++) {
+		long varind=variable_index(xx,yy,zz);
+		if (varind>=0) {
+			if (begin<0) begin=varind;
+			end=varind+3;
+		}
+	}
+	if (begin<0) return;
+	begin=(begin/3)*m_x.vertex_stride;
+	end=(end/3)*m_x.vertex_stride;
+	for (long ii=begin; ii<end; ii+=FLOATS_PER_CACHE_LINE) FB_PREFETCH(&m_x.ptr[ii]);
+}
+
+void prefetch_next_lines(FBPrefetchCursor &C) {
+	long lines=C.lines_per_step;
+	while ((lines>0)&&(C.span_index<C.num_spans)) {
+		long begin=(C.spans[C.span_index].begin/3)*C.vertex_stride;
+		long end=(C.spans[C.span_index].end/3)*C.vertex_stride;
+		long ii=begin+C.offset;
+		FB_PREFETCH(&C.X[ii]);
+		if (C.Y) FB_PREFETCH(&C.Y[ii]);
+		C.offset+=FLOATS_PER_CACHE_LINE;
+		if (begin+C.offset>=end) {
+			C.span_index++;
+			C.offset=0;
+		}
+		lines--;
+	}
+}
+
+void FBBlockPrivate::setup_reaction_moments() {
+	//In step B the reaction forces change by -alpha*Ap on the fixed variables, so their moment k=3*dd+ee changes by
+	//-alpha*sum(G_k*p), where G_k=A*w_k and w_k holds the lever arm ee on the fixed variables of direction dd.
+	//A is symmetric, so G_k is assembled from the element rows of the fixed variables (as in vertex_product);
+	//it is nonzero only on the vertices of the elements around the fixed variables.
+	for (int kk=0; kk<9; kk++) m_fixed_moments[kk]=0;
+	for (long ii=0; ii<m_fixed_variables.count(); ii++) {
+		int dd=m_fixed_variables[ii].ref_index%3;
+		for (int ee=0; ee<3; ee++) m_fixed_moments[dd*3+ee]+=m_r_fixed.ptr[ii]*m_fixed_lever_arms.ptr[ii*3+ee];
+	}
+	QVector<long> vertex_positions(m_num_variables/3,-1); //in m_reaction_vertices
+	for (long ii=0; ii<m_fixed_variables.count(); ii++) {
+		const FBVertexLocation *VL=&m_fixed_variables[ii];
+		int dd=VL->ref_index%3;
+		const float *L=&m_fixed_lever_arms.ptr[ii*3];
+		for (int aa=0; aa<8; aa++) {
+			int ex=VL->x-aa%2,ey=VL->y-(aa/2)%2,ez=VL->z-aa/4;
+			unsigned char bvf=m_bvf_map.value(ex,ey,ez);
+			if (!bvf) continue;
+			float bvf_factor=bvf*1.0/100;
+			for (int bb=0; bb<8; bb++) {
+				long vv=m_vertices.index(ex+bb%2,ey+(bb/2)%2,ez+bb/4);
+				if (vertex_positions[vv]<0) {
+					vertex_positions[vv]=m_reaction_vertices.count();
+					m_reaction_vertices << vv;
+					for (int jj=0; jj<27; jj++) m_reaction_coefficients << 0;
+				}
+				float *G=&m_reaction_coefficients[vertex_positions[vv]*27];
+				const float *K=&m_stiffness_data[(aa*3+dd)*24+bb*3];
+				for (int ee2=0; ee2<3; ee2++) {
+					for (int ee=0; ee<3; ee++) G[ee2*9+dd*3+ee]+=K[ee2]*bvf_factor*L[ee];
+				}
+			}
+		}
+	}
+}
+
+//the stress sums of compute_stress from the first moments M[3*dd+ee]=sum(f_dd*x_ee) of the forces f at the positions x
+QList<double> stress_from_moments(const double M[9]) {
+	QList<double> ret;
+	ret << M[0]; //sigma_11
+	ret << M[4]; //sigma_22
+	ret << M[8]; //sigma_33
+	ret << (M[1]+M[3])*0.5; //sigma_12
+	ret << (M[2]+M[6])*0.5; //sigma_13
+	ret << (M[5]+M[7])*0.5; //sigma_23
+	return ret;
+}
+
 void FBBlock::iterate_step_A(FBBlockIterateStepAParameters &P) {
 	//update p on the outer interface (only free variables)
 	/*for (int ii=0; ii<d->m_outer_vertex_locations.count(); ii++) {
 		FBVertexLocation *VL=&d->m_outer_vertex_locations[ii];
 		for (int dd=0; dd<3; dd++) {
 			long varind=VL->ref_index+dd;
-			if (d->m_free.ptr[varind]) {
-				d->m_p.ptr[varind]=P.p_on_outer_interface.value(dd,VL->x,VL->y,VL->z);
+			if (d->is_free(varind)) {
+				d->m_p[varind]=P.p_on_outer_interface.value(dd,VL->x,VL->y,VL->z);
 			}
 		}
 	}*/
 	
 	if (d->m_nonlinear_adjuster) {
 		//if we are adjusting the A matrix, like in a nonlinear simulation, then we NEED to reinitialize the residual at the beginning of each iteration!
-		//initialize r = -Ax (note that x is defined even on the fixed variables, so we don't need b)
-		d->multiply_by_A(d->m_r,d->m_x); //r=Ax
-		for (long ii=0; ii<d->m_num_variables; ii++) {
-			d->m_r.ptr[ii]*=-1; //multiply r by -1: r = -Ax
-		}
+		d->initialize_residual();
 	}
 	
 	for (int ii=0; ii<d->m_outer_vertex_locations.count(); ii++) {
 		FBVertexLocation *VL=&d->m_outer_vertex_locations[ii];
 		for (int dd=0; dd<3; dd++) {
 			long varind=VL->ref_index+dd;
-			if (d->m_free.ptr[varind]) {
-				if (VL->z==0) d->m_p.ptr[varind]=P.p_on_top_outer_interface.value(dd,VL->x-1,VL->y-1);
-				else if (VL->z==d->m_Nz+1) d->m_p.ptr[varind]=P.p_on_bottom_outer_interface.value(dd,VL->x-1,VL->y-1);
+			if (d->is_free(varind)) {
+				if (VL->z==0) d->m_p[varind]=P.p_on_top_outer_interface.value(dd,VL->x-1,VL->y-1);
+				else if (VL->z==d->m_Nz+1) d->m_p[varind]=P.p_on_bottom_outer_interface.value(dd,VL->x-1,VL->y-1);
 			}
 		}
 	}
@@ -286,53 +784,67 @@ void FBBlock::iterate_step_A(FBBlockIterateStepAParameters &P) {
 	
 	//update x,r,p, and Ap according to alpha and beta
 	//now, p is defined everywhere, so we can do the following multiplication
-	FBTimer::startTimer(QString("step_A_multipy_by_A-thread-%1").arg(d->m_block_id));
-	d->multiply_by_A(d->m_Ap,d->m_p); 
-	FBTimer::stopTimer(QString("step_A_multipy_by_A-thread-%1").arg(d->m_block_id));
-	//now Ap is defined on the owned vertices
+	//(in low-memory mode Ap is not stored; compute_step_A_products forms it vertex by vertex)
+	if (!d->m_low_memory) {
+		FBTimer::startTimer(QString("step_A_multipy_by_A-thread-%1").arg(d->m_block_id));
+		d->multiply_by_A(d->m_Ap,d->m_p); 
+		if (d->fixed_eliminated()) {
+			d->zero_fixed_values(d->m_Ap);
+			//the change of the reaction moments in step B (p is only complete here, step B updates it)
+			for (int kk=0; kk<9; kk++) d->m_fixed_moment_changes[kk]=0;
+			for (long ii=0; ii<d->m_reaction_vertices.count(); ii++) {
+				const float *P0=d->m_p.vertex(d->m_reaction_vertices[ii]*3);
+				const float *G=&d->m_reaction_coefficients[ii*27];
+				for (int kk=0; kk<9; kk++) d->m_fixed_moment_changes[kk]+=P0[0]*G[kk]+P0[1]*G[9+kk]+P0[2]*G[18+kk];
+			}
+		}
+		else d->move_fixed_values(d->m_Ap,d->m_Ap_fixed);
+		FBTimer::stopTimer(QString("step_A_multipy_by_A-thread-%1").arg(d->m_block_id));
+		//now Ap is defined on the owned vertices
+	}
 	
 	//here's the output
 	FBTimer::startTimer(QString("step_A_inner_products-thread-%1").arg(d->m_block_id));
-	if (d->m_use_precondioner) {
-		P.r_z=d->inner_product_on_owned_free_variables(d->m_r,d->m_r,d->m_preconditioner);
-		P.r_Ap=d->inner_product_on_owned_free_variables(d->m_r,d->m_Ap,d->m_preconditioner);
-		P.Ap_Ap=d->inner_product_on_owned_free_variables(d->m_Ap,d->m_Ap,d->m_preconditioner);
-	}
-	else {
-		P.r_z=d->inner_product_on_owned_free_variables(d->m_r,d->m_r);
-		P.r_Ap=d->inner_product_on_owned_free_variables(d->m_r,d->m_Ap);
-		P.Ap_Ap=d->inner_product_on_owned_free_variables(d->m_Ap,d->m_Ap);
-	}
-	P.p_Ap=d->inner_product_on_owned_free_variables(d->m_p,d->m_Ap);
+	FBStepAProducts products;
+	d->compute_step_A_products(products);
+	P.r_z=products.r_z;
+	P.r_Ap=products.r_Ap;
+	P.Ap_Ap=products.Ap_Ap;
+	P.p_Ap=products.p_Ap;
 	FBTimer::stopTimer(QString("step_A_inner_products-thread-%1").arg(d->m_block_id));
 }
 void FBBlock::iterate_step_B(FBBlockIterateStepBParameters &P) {
+	//update x, r and p, and compute r_r in the same pass
+	//and the first moments of r (the forces on the free variables) in the same pass
+	double moments[9];
+	for (int kk=0; kk<9; kk++) moments[kk]=0;
 	FBTimer::startTimer(QString("step_B_update_p-thread-%1").arg(d->m_block_id));
-	
-	for (long ii=0; ii<d->m_num_variables; ii++) {
-		d->m_r.ptr[ii]=d->m_r.ptr[ii]-d->m_Ap.ptr[ii]*P.alpha; //r is never valid on the outer interface
-		if (d->m_free.ptr[ii]) {
-			d->m_x.ptr[ii]=d->m_x.ptr[ii]+d->m_p.ptr[ii]*P.alpha; //x is valid everywhere			
-			if ((d->m_use_precondioner)&&(d->m_preconditioner.ptr[ii])) {
-				qDebug() << __FUNCTION__ << __LINE__ << "using preconditioner";
-				d->m_p.ptr[ii]=d->m_p.ptr[ii]*P.beta+d->m_r.ptr[ii]/d->m_preconditioner.ptr[ii]; //p is now not valid on the outer interface
-			}
-			else {
-				d->m_p.ptr[ii]=d->m_p.ptr[ii]*P.beta+d->m_r.ptr[ii]; //p is now not valid on the outer interface
-			}
-		}
-	}
-	
+	P.r_r=d->update_x_r_p(P.alpha,P.beta,d->m_stress_from_reactions ? 0 : moments);
 	FBTimer::stopTimer(QString("step_B_update_p-thread-%1").arg(d->m_block_id));
 
+	//the moments of the reaction forces on the fixed variables
 	FBTimer::startTimer(QString("step_B_p_inner_products-thread-%1").arg(d->m_block_id));
-	P.r_r=d->inner_product_on_owned_free_variables(d->m_r,d->m_r);
-	P.bb_bb=d->inner_product_on_owned_fixed_variables(d->m_r,d->m_r);
+	P.bb_bb=0;
+	if (d->fixed_eliminated()) {
+		//the reaction forces themselves are left behind (bb_bb is not computed)
+		for (int kk=0; kk<9; kk++) {
+			d->m_fixed_moments[kk]-=P.alpha*d->m_fixed_moment_changes[kk];
+			moments[kk]+=d->m_fixed_moments[kk];
+		}
+		d->m_reactions_current=false;
+	}
+	else for (long ii=0; ii<d->m_fixed_variables.count(); ii++) {
+		float ff=d->m_r_fixed.ptr[ii];
+		const float *L=&d->m_fixed_lever_arms.ptr[ii*3];
+		int dd=d->m_fixed_variables[ii].ref_index%3;
+		P.bb_bb+=ff*ff;
+		moments[dd*3+0]+=ff*L[0];
+		moments[dd*3+1]+=ff*L[1];
+		moments[dd*3+2]+=ff*L[2];
+	}
 	FBTimer::stopTimer(QString("step_B_p_inner_products-thread-%1").arg(d->m_block_id));
 	
-	FBTimer::startTimer(QString("step_B_compute_stress-thread-%1").arg(d->m_block_id));
-	P.stress=d->compute_stress();
-	FBTimer::stopTimer(QString("step_B_compute_stress-thread-%1").arg(d->m_block_id));
+	P.stress=stress_from_moments(moments);
 
 	//here's the output
 	//set p on the inner interface (free variables only)
@@ -342,9 +854,9 @@ void FBBlock::iterate_step_B(FBBlockIterateStepBParameters &P) {
 		FBVertexLocation *VL=&d->m_inner_vertex_locations[ii];
 		for (int dd=0; dd<3; dd++) {
 			long varind=VL->ref_index+dd;
-			if (d->m_free.ptr[varind]) {
+			if (d->is_free(varind)) {
 				if (pass<=2) P.p_on_inner_interface.setupIndex(pass,dd,VL->x,VL->y,VL->z);
-				else if (pass==3) P.p_on_inner_interface.setValue(d->m_p.ptr[varind],dd,VL->x,VL->y,VL->z);
+				else if (pass==3) P.p_on_inner_interface.setValue(d->m_p[varind],dd,VL->x,VL->y,VL->z);
 			}
 		}
 	}*/
@@ -356,9 +868,9 @@ void FBBlock::iterate_step_B(FBBlockIterateStepBParameters &P) {
 		FBVertexLocation *VL=&d->m_inner_vertex_locations[ii];
 		for (int dd=0; dd<3; dd++) {
 			long varind=VL->ref_index+dd;
-			if (d->m_free.ptr[varind]) {
-				if (VL->z==1) P.p_on_top_inner_interface.setValue(d->m_p.ptr[varind],dd,VL->x-1,VL->y-1);
-				else if (VL->z==d->m_Nz) P.p_on_bottom_inner_interface.setValue(d->m_p.ptr[varind],dd,VL->x-1,VL->y-1);
+			if (d->is_free(varind)) {
+				if (VL->z==1) P.p_on_top_inner_interface.setValue(d->m_p[varind],dd,VL->x-1,VL->y-1);
+				else if (VL->z==d->m_Nz) P.p_on_bottom_inner_interface.setValue(d->m_p[varind],dd,VL->x-1,VL->y-1);
 			}
 		}
 	}
@@ -366,211 +878,847 @@ void FBBlock::iterate_step_B(FBBlockIterateStepBParameters &P) {
 	
 	if (d->m_nonlinear_adjuster) {
 		FBTimer::startTimer(QString("step_B_compute_strains-%1").arg(d->m_block_id));
-		FBSparseArray4D energy_map0;
-		computeEnergyMap(energy_map0);
-		//bool strain_is_bad=false;
-		long ct=0;
-		for (long zz=0; zz<d->m_Nz+1; zz++)
-		for (long yy=0; yy<d->m_Ny+1; yy++)
-		for (long xx=0; xx<d->m_Nx+1; xx++)  {
-			if (d->m_bvf_map.value(xx,yy,zz)) {
-				float energy0=energy_map0.value(0,xx,yy,zz);
-				float bvf_factor=d->m_elements[ct].bvf*1.0/100;
-				float YM=d->m_youngs_modulus;
-				float voxel_volume=d->m_voxel_volume;
-				d->m_elements[ct].strain=sqrt(2*qAbs(energy0)/(voxel_volume*YM*bvf_factor));
-				//if ((d->m_elements[ct].strain)&&((d->m_elements[ct].strain>1.15)||(d->m_elements[ct].strain<0.85))) strain_is_bad=true;
-				/*float len_x=-getDisplacement(xx+1,yy,zz,0)+getDisplacement(xx,yy,zz,0)+1; //this needs to be fixed, for resolution!
-				float len_y=-getDisplacement(xx,yy+1,zz,1)+getDisplacement(xx,yy,zz,1)+1;
-				float len_z=-getDisplacement(xx,yy,zz+1,2)+getDisplacement(xx,yy,zz,2)+1;
-				float vol0=len_x*len_y*len_z;
-				float volume_ratio=qAbs(vol0/d->m_voxel_volume);
-				if (volume_ratio<1) d->m_elements[ct].strain=1-volume_ratio;
-				else d->m_elements[ct].strain=0;
-				if (ct==0) qDebug() << "@#@#@#@#" << len_x << len_y << len_z << vol0 << volume_ratio << d->m_elements[ct].strain;*/
-				ct++;
-			}
+		//visit the elements tile by tile, as in multiply_by_A
+		if (d->m_team.threadCount()>1) {
+			d->run_on_tiles(TILE_OPERATION_STRAINS,0,0);
 		}
-		/*if (strain_is_bad) {
-			write_mda(energy_map0,"c:/dev/projects/fbblock/test/energy.mda");
-			FBArray4D<float> displacements;
-			displacements.allocate(3,d->m_Nx+2,d->m_Ny+2,d->m_Nz+2);
-			for (long zz=0; zz<d->m_Nz+2; zz++)
-			for (long yy=0; yy<d->m_Ny+2; yy++)
-			for (long xx=0; xx<d->m_Nx+2; xx++) 
-			for (int dd=0; dd<3; dd++) {
-				displacements.setValue(getDisplacement(xx,yy,zz,dd),dd,xx,yy,zz);
+		else {
+			for (int tt=0; tt<d->m_tiles.count(); tt++) {
+				const FBElementTile *T=&d->m_tiles[tt];
+				FBPrefetchCursor C;
+				d->start_prefetch(C,tt+1,&d->m_x,0);
+				for (long i=T->begin; i<T->end; i+=ELEMENTS_PER_PREFETCH_STEP) {
+					prefetch_next_lines(C);
+					d->compute_element_strains(i,qMin(i+ELEMENTS_PER_PREFETCH_STEP,T->end));
+				}
 			}
-			write_mda(displacements,"c:/dev/projects/fbblock/test/displacements.mda");
-			
-			exit(0);
-		}*/
+		}
+		d->update_element_factors();
 		FBTimer::stopTimer(QString("step_B_compute_strains-%1").arg(d->m_block_id));
 		
 	}
 }
 	
-double FBBlockPrivate::inner_product_on_owned_free_variables(const FBArray1D<float> &V1,const FBArray1D<float> &V2) {
-	double ret=0;
-	for (long ii=0; ii<m_num_variables; ii++) {
-		if ((m_vertex_type.ptr[ii]!=3)&&(m_free.ptr[ii])) {
-			ret+=V1.ptr[ii]*V2.ptr[ii];
+void FBBlockPrivate::allocate_vectors() {
+	for (int i=0; i<4; i++) m_vector_storage[i].clear();
+	FBBlockVector *vectors[4]={&m_x,&m_r,&m_p,&m_Ap};
+	for (int i=0; i<4; i++) {
+		if (m_vector_layout==VECTOR_LAYOUT_INTERLEAVED) {
+			if ((i==0)&&(m_num_variables)) m_vector_storage[0].allocate(m_num_variables*4,&m_result_arena);
+			vectors[i]->ptr=m_vector_storage[0].ptr ? m_vector_storage[0].ptr+3*i : 0;
+			vectors[i]->vertex_stride=12;
+		}
+		else {
+			//x and r are still needed after the iterations (see clearArrays)
+			if ((i==3)&&(m_low_memory)) {
+				vectors[i]->ptr=0;
+				vectors[i]->vertex_stride=3;
+				continue;
+			}
+			if (m_num_variables) m_vector_storage[i].allocate(m_num_variables,(i<2) ? &m_result_arena : &m_arena);
+			vectors[i]->ptr=m_vector_storage[i].ptr;
+			vectors[i]->vertex_stride=3;
 		}
 	}
-	return ret;
 }
-double FBBlockPrivate::inner_product_on_owned_free_variables(const FBArray1D<float> &V1,const FBArray1D<float> &V2,const FBArray1D<float> &V3) {
+
+void FBBlockPrivate::set_to_zero(FBBlockVector &V) {
+	long num_vertices=m_num_variables/3;
+	for (long vv=0; vv<num_vertices; vv++) {
+		float *V0=&V.ptr[vv*V.vertex_stride];
+		V0[0]=V0[1]=V0[2]=0;
+	}
+}
+
+double FBBlockPrivate::inner_product_on_owned_free_variables(const FBBlockVector &V1,const FBBlockVector &V2) {
+	//V1 or V2 is zero on the fixed and outer-interface variables (see m_fixed_variables)
 	double ret=0;
 	for (long ii=0; ii<m_num_variables; ii++) {
-		if ((m_vertex_type.ptr[ii]!=3)&&(m_free.ptr[ii])) {
-      			if (V3.ptr[ii]) ret+=V1.ptr[ii]*V2.ptr[ii]/V3.ptr[ii];
-      			else ret+=V1.ptr[ii]*V2.ptr[ii];
-		}
+		ret+=V1[ii]*V2[ii];
 	}
 	return ret;
 }
-	
-double FBBlockPrivate::inner_product_on_owned_fixed_variables(const FBArray1D<float> &V1,const FBArray1D<float> &V2) {
+
+void FBBlockPrivate::move_fixed_values(FBBlockVector &V,FBArray1D<float> &V_fixed) {
+	for (long ii=0; ii<m_fixed_variables.count(); ii++) {
+		long varind=m_fixed_variables[ii].ref_index;
+		V_fixed.ptr[ii]=V[varind];
+		V[varind]=0;
+	}
+}
+
+void FBBlockPrivate::zero_fixed_values(FBBlockVector &V) {
+	for (long ii=0; ii<m_fixed_variables.count(); ii++) {
+		V[m_fixed_variables[ii].ref_index]=0;
+	}
+}
+
+void FBBlockPrivate::initialize_residual() {
+	//initialize r = -Ax (note that x is defined even on the fixed variables, so we don't need b)
+	if (m_low_memory) {
+		run_low_memory_sweep(LOW_MEMORY_RESIDUAL,0,0,0,0,0);
+		return;
+	}
+	multiply_by_A(m_r,m_x); //r=Ax
+	long num_vertices=m_num_variables/3;
+	for (long vv=0; vv<num_vertices; vv++) {
+		float *R=&m_r.ptr[vv*m_r.vertex_stride];
+		for (int dd=0; dd<3; dd++) R[dd]*=-1; //multiply r by -1: r = -Ax
+	}
+	move_fixed_values(m_r,m_r_fixed);
+}
+
+long FBBlockPrivate::fixed_variable_position(long varind) {
+	//binary search in m_fixed_variables, -1 if varind is not an owned fixed variable
+	long i1=0,i2=m_fixed_variables.count()-1;
+	while (i1<=i2) {
+		long ii=(i1+i2)/2;
+		long val=m_fixed_variables[ii].ref_index;
+		if (val==varind) return ii;
+		else if (val<varind) i1=ii+1;
+		else i2=ii-1;
+	}
+	return -1;
+}
+
+//Runs the fused vector kernels on contiguous pieces of the vectors, one per thread of the block.
+//The partial sums are added in a fixed order, so the result does not depend on the scheduling.
+class FBVectorTask : public FBWorkerTask {
+public:
+	FBBlockPrivate *block;
+	bool step_A;
+	double alpha,beta;
+	QVector<FBStepAProducts> products;
+	QVector<double> r_r;
+	QVector<double> moments; //9 per thread, empty if they are not wanted
+	void run(int thread_index) {
+		FBBlockPrivate *d=block;
+		int num_threads=d->m_team.threadCount();
+		long num_vertices=d->m_num_variables/3;
+		long begin=(num_vertices*thread_index/num_threads)*3;
+		long end=(num_vertices*(thread_index+1)/num_threads)*3;
+		const float *C=0;
+		if (d->m_use_precondioner) C=d->m_preconditioner.ptr;
+		long stride=d->m_x.vertex_stride;
+		if (step_A) fused_step_A_products(products[thread_index],begin,end,d->m_r.ptr,d->m_p.ptr,d->m_Ap.ptr,C,stride);
+		else if (!moments.isEmpty()) r_r[thread_index]=fused_step_B_update_with_moments(begin,end,d->m_x.ptr,d->m_r.ptr,d->m_p.ptr,d->m_Ap.ptr,C,alpha,beta,stride,d->m_lever_arms.ptr,&moments[thread_index*9]);
+		else r_r[thread_index]=fused_step_B_update(begin,end,d->m_x.ptr,d->m_r.ptr,d->m_p.ptr,d->m_Ap.ptr,C,alpha,beta,stride);
+	}
+};
+
+void FBBlockPrivate::compute_step_A_products(FBStepAProducts &ret) {
+	//r, p and Ap are zero on the fixed and outer-interface variables, so these are the products over the owned free variables
+	if (m_low_memory) {
+		run_low_memory_sweep(LOW_MEMORY_PRODUCTS,0,0,&ret,0,0);
+		return;
+	}
+	FBVectorTask task;
+	task.block=this;
+	task.step_A=true;
+	task.alpha=task.beta=0;
+	task.products.resize(m_team.threadCount());
+	m_team.run(&task);
+	ret.r_z=ret.r_Ap=ret.Ap_Ap=ret.p_Ap=0;
+	for (int i=0; i<task.products.count(); i++) {
+		ret.r_z+=task.products[i].r_z;
+		ret.r_Ap+=task.products[i].r_Ap;
+		ret.Ap_Ap+=task.products[i].Ap_Ap;
+		ret.p_Ap+=task.products[i].p_Ap;
+	}
+}
+
+double FBBlockPrivate::update_x_r_p(double alpha,double beta,double *moments) {
+	//p, r and Ap are zero on the fixed variables, so x and p only change on the free variables
+	if (m_low_memory) {
+		double ret=0;
+		run_low_memory_sweep(LOW_MEMORY_UPDATE,alpha,beta,0,&ret,moments);
+		return ret;
+	}
+	FBVectorTask task;
+	task.block=this;
+	task.step_A=false;
+	task.alpha=alpha;
+	task.beta=beta;
+	task.r_r.resize(m_team.threadCount());
+	if (moments) task.moments.fill(0,m_team.threadCount()*9);
+	m_team.run(&task);
 	double ret=0;
-	for (long ii=0; ii<m_num_variables; ii++) {
-		if ((m_vertex_type.ptr[ii]!=3)&&(!m_free.ptr[ii])) {
-			ret+=V1.ptr[ii]*V2.ptr[ii];
-		}
+	for (int i=0; i<task.r_r.count(); i++) ret+=task.r_r[i];
+	for (int i=0; i<task.moments.count(); i++) moments[i%9]+=task.moments[i];
+	if (fixed_eliminated()) return ret;
+	for (long ii=0; ii<m_fixed_variables.count(); ii++) {
+		m_r_fixed.ptr[ii]=m_r_fixed.ptr[ii]-m_Ap_fixed.ptr[ii]*alpha;
 	}
 	return ret;
 }
-void FBBlockPrivate::multiply_by_A(FBArray1D<float> &Y,const FBArray1D<float> &X) { //Y=AX
-	Y.setAll(0);
-	
-	float *stiffness_matrix_data=(float *)malloc(sizeof(float)*24*24);
-	int ct=0;
-	for (int rr=0; rr<24; rr++)
-	for (int cc=0; cc<24; cc++) {
-		stiffness_matrix_data[ct]=m_stiffness_matrix.value(rr,cc);
-		ct++;
+
+void FBBlockPrivate::vertex_product(int xx,int yy,int zz,const FBBlockVector &X,float Y[3]) {
+	//The vertex is corner aa=a1+2*a2+4*a3 of the element (xx-a1,yy-a2,zz-a3), so it receives rows 3*aa..3*aa+2
+	//of the element product; this is the same sum as in multiply_elements_by_A, collected at one vertex.
+	long neighbors[27]; //vertex indices of the 3x3x3 neighborhood, looked up when first needed
+	for (int nn=0; nn<27; nn++) neighbors[nn]=-1;
+	Y[0]=Y[1]=Y[2]=0;
+	for (int aa=0; aa<8; aa++) {
+		int ex=xx-aa%2,ey=yy-(aa/2)%2,ez=zz-aa/4;
+		unsigned char bvf=m_bvf_map.value(ex,ey,ez);
+		if (!bvf) continue;
+		float Y0[3]={0,0,0};
+		for (int bb=0; bb<8; bb++) {
+			int nn=(bb%2-aa%2+1)+3*((bb/2)%2-(aa/2)%2+1)+9*(bb/4-aa/4+1);
+			if (neighbors[nn]<0) neighbors[nn]=m_vertices.index(xx-1+nn%3,yy-1+(nn/3)%3,zz-1+nn/9);
+			const float *X0=&X.ptr[neighbors[nn]*X.vertex_stride];
+			for (int dd=0; dd<3; dd++) {
+				const float *K=&m_stiffness_data[(aa*3+dd)*24+bb*3];
+				Y0[dd]+=K[0]*X0[0]+K[1]*X0[1]+K[2]*X0[2];
+			}
+		}
+		float bvf_factor=bvf*1.0/100;
+		for (int dd=0; dd<3; dd++) Y[dd]+=Y0[dd]*bvf_factor;
+	}
+}
+
+void FBBlockPrivate::vertex_preconditioner(int xx,int yy,int zz,long vv,float C[3]) {
+	C[0]=C[1]=C[2]=1;
+	if (!m_use_precondioner) return;
+	int free_mask=m_vertex_flags.ptr[vv]&VERTEX_FREE_MASK;
+	float diag[3]={0,0,0};
+	for (int aa=0; aa<8; aa++) {
+		unsigned char bvf=m_bvf_map.value(xx-aa%2,yy-(aa/2)%2,zz-aa/4);
+		if (!bvf) continue;
+		for (int dd=0; dd<3; dd++) diag[dd]+=m_stiffness_data[(aa*3+dd)*25]*(bvf*1.0/100);
+	}
+	for (int dd=0; dd<3; dd++) {
+		if (((free_mask>>dd)&1)&&(diag[dd])) C[dd]=diag[dd];
+	}
+}
+
+void FBBlockPrivate::plane_range(int thread_index,int num_threads,int &z0,int &z1) const {
+	z0=1+(int)(((long)m_Nz)*thread_index/num_threads);
+	z1=(int)(((long)m_Nz)*(thread_index+1)/num_threads);
+}
+
+bool FBBlockPrivate::plane_is_deferred(int zz,int z0,int z1) const {
+	//the first and last planes of a range are also read by the products of the neighboring ranges,
+	//so in the update sweep their p can only change once all threads are done
+	return (((zz==z0)&&(z0>1))||((zz==z1)&&(z1<m_Nz)));
+}
+
+void FBBlockPrivate::low_memory_residual(int zz) {
+	for (int yy=1; yy<=m_Ny; yy++)
+	for (int xx=1; xx<=m_Nx; xx++) {
+		long vv=m_vertices.index(xx,yy,zz);
+		if (vv<0) continue;
+		float Y[3];
+		vertex_product(xx,yy,zz,m_x,Y);
+		int free_mask=m_vertex_flags.ptr[vv]&VERTEX_FREE_MASK;
+		float *R=m_r.vertex(vv*3);
+		for (int dd=0; dd<3; dd++) {
+			if ((free_mask>>dd)&1) R[dd]=-Y[dd];
+			else {
+				R[dd]=0;
+				m_r_fixed.ptr[fixed_variable_position(vv*3+dd)]=-Y[dd];
+			}
+		}
+	}
+}
+
+void FBBlockPrivate::low_memory_products(int zz,FBStepAProducts &ret) {
+	for (int yy=1; yy<=m_Ny; yy++)
+	for (int xx=1; xx<=m_Nx; xx++) {
+		long vv=m_vertices.index(xx,yy,zz);
+		if (vv<0) continue;
+		float Ap[3],C[3];
+		vertex_product(xx,yy,zz,m_p,Ap);
+		vertex_preconditioner(xx,yy,zz,vv,C);
+		int free_mask=m_vertex_flags.ptr[vv]&VERTEX_FREE_MASK;
+		const float *R=m_r.vertex(vv*3);
+		const float *P=m_p.vertex(vv*3);
+		for (int dd=0; dd<3; dd++) {
+			if (!((free_mask>>dd)&1)) continue; //Ap is zero on the fixed variables
+			float zz0=R[dd]/C[dd];
+			float BB=Ap[dd]/C[dd];
+			ret.r_z+=R[dd]*zz0;
+			ret.r_Ap+=R[dd]*BB;
+			ret.Ap_Ap+=Ap[dd]*BB;
+			ret.p_Ap+=P[dd]*Ap[dd];
+		}
+	}
+}
+
+void FBBlockPrivate::low_memory_update_r_x(int zz,double alpha) {
+	for (int yy=1; yy<=m_Ny; yy++)
+	for (int xx=1; xx<=m_Nx; xx++) {
+		long vv=m_vertices.index(xx,yy,zz);
+		if (vv<0) continue;
+		float Ap[3];
+		vertex_product(xx,yy,zz,m_p,Ap);
+		int free_mask=m_vertex_flags.ptr[vv]&VERTEX_FREE_MASK;
+		float *R=m_r.vertex(vv*3);
+		float *X=m_x.vertex(vv*3);
+		const float *P=m_p.vertex(vv*3);
+		for (int dd=0; dd<3; dd++) {
+			if ((free_mask>>dd)&1) R[dd]=R[dd]-Ap[dd]*alpha;
+			else {
+				long ind=fixed_variable_position(vv*3+dd);
+				m_r_fixed.ptr[ind]=m_r_fixed.ptr[ind]-Ap[dd]*alpha;
+			}
+			X[dd]=X[dd]+P[dd]*alpha;
+		}
+	}
+}
+
+double FBBlockPrivate::low_memory_update_p(int zz,double beta,double *moments) {
+	double r_r=0;
+	double M[9];
+	for (int kk=0; kk<9; kk++) M[kk]=0;
+	//the lever arms are not stored in low-memory mode, the position is known here anyway
+	float L[3];
+	L[2]=(m_block_z_position+zz-1)*m_resolution[2];
+	for (int yy=1; yy<=m_Ny; yy++) {
+		L[1]=(m_block_y_position+yy-1)*m_resolution[1];
+		for (int xx=1; xx<=m_Nx; xx++) {
+			long vv=m_vertices.index(xx,yy,zz);
+			if (vv<0) continue;
+			float C[3];
+			vertex_preconditioner(xx,yy,zz,vv,C);
+			const float *R=m_r.vertex(vv*3);
+			float *P=m_p.vertex(vv*3);
+			L[0]=(m_block_x_position+xx-1)*m_resolution[0];
+			for (int dd=0; dd<3; dd++) {
+				P[dd]=P[dd]*beta+R[dd]/C[dd]; //r and p are zero on the fixed variables
+				r_r+=R[dd]*R[dd];
+				M[dd*3+0]+=R[dd]*L[0];
+				M[dd*3+1]+=R[dd]*L[1];
+				M[dd*3+2]+=R[dd]*L[2];
+			}
+		}
+	}
+	if (moments) {
+		for (int kk=0; kk<9; kk++) moments[kk]+=M[kk];
+	}
+	return r_r;
+}
+
+//Runs one of the low-memory sweeps, with a contiguous range of planes per thread.
+//In the update sweep, p of a plane is replaced as soon as the products of the planes above and below
+//no longer need it, so Ap never has to be stored; see plane_is_deferred for the planes at the range boundaries.
+class FBLowMemoryTask : public FBWorkerTask {
+public:
+	FBBlockPrivate *block;
+	int operation;
+	double alpha,beta;
+	QVector<FBStepAProducts> products;
+	QVector<double> r_r;
+	QVector<double> moments; //9 per thread, see low_memory_update_p
+	bool with_moments;
+	void run(int thread_index) {
+		FBBlockPrivate *d=block;
+		int z0,z1;
+		d->plane_range(thread_index,d->m_team.threadCount(),z0,z1);
+		FBStepAProducts *P=&products[thread_index];
+		P->r_z=P->r_Ap=P->Ap_Ap=P->p_Ap=0;
+		r_r[thread_index]=0;
+		double *M=with_moments ? &moments[thread_index*9] : 0;
+		for (int zz=z0; zz<=z1; zz++) {
+			if (operation==LOW_MEMORY_RESIDUAL) d->low_memory_residual(zz);
+			else if (operation==LOW_MEMORY_PRODUCTS) d->low_memory_products(zz,*P);
+			else if (operation==LOW_MEMORY_UPDATE) {
+				d->low_memory_update_r_x(zz,alpha);
+				if ((zz>z0)&&(!d->plane_is_deferred(zz-1,z0,z1))) r_r[thread_index]+=d->low_memory_update_p(zz-1,beta,M);
+			}
+		}
+		if ((operation==LOW_MEMORY_UPDATE)&&(z1>=z0)&&(!d->plane_is_deferred(z1,z0,z1))) {
+			r_r[thread_index]+=d->low_memory_update_p(z1,beta,M);
+		}
+	}
+};
+
+void FBBlockPrivate::run_low_memory_sweep(int operation,double alpha,double beta,FBStepAProducts *products,double *r_r,double *moments) {
+	int num_threads=m_team.threadCount();
+	FBLowMemoryTask task;
+	task.block=this;
+	task.operation=operation;
+	task.alpha=alpha;
+	task.beta=beta;
+	task.products.resize(num_threads);
+	task.r_r.resize(num_threads);
+	task.with_moments=(moments!=0);
+	task.moments.fill(0,num_threads*9);
+	m_team.run(&task);
+	if (products) {
+		products->r_z=products->r_Ap=products->Ap_Ap=products->p_Ap=0;
+		for (int i=0; i<num_threads; i++) {
+			products->r_z+=task.products[i].r_z;
+			products->r_Ap+=task.products[i].r_Ap;
+			products->Ap_Ap+=task.products[i].Ap_Ap;
+			products->p_Ap+=task.products[i].p_Ap;
+		}
+	}
+	if (operation==LOW_MEMORY_UPDATE) {
+		double ret=0;
+		for (int i=0; i<num_threads; i++) {
+			ret+=task.r_r[i];
+			int z0,z1;
+			plane_range(i,num_threads,z0,z1);
+			if (z1<z0) continue;
+			if (plane_is_deferred(z0,z0,z1)) ret+=low_memory_update_p(z0,beta,moments);
+			if ((z1!=z0)&&(plane_is_deferred(z1,z0,z1))) ret+=low_memory_update_p(z1,beta,moments);
+		}
+		if (moments) {
+			for (int i=0; i<task.moments.count(); i++) moments[i%9]+=task.moments[i];
+		}
+		//x is also kept up to date on the outer interface, where p holds the values of the neighboring blocks
+		for (int ii=0; ii<m_outer_vertex_locations.count(); ii++) {
+			float *X=m_x.vertex(m_outer_vertex_locations[ii].ref_index);
+			const float *P=m_p.vertex(m_outer_vertex_locations[ii].ref_index);
+			for (int dd=0; dd<3; dd++) X[dd]=X[dd]+P[dd]*alpha;
+		}
+		*r_r=ret;
+	}
+}
+
+void FBBlockPrivate::select_kernels() {
+	bool interleaved=(m_vector_layout==VECTOR_LAYOUT_INTERLEAVED);
+	if (m_nonlinear_adjuster) {
+		if (interleaved) {
+			m_multiply_interior_kernel=&FBBlockPrivate::multiply_elements_by_A<true,false,true>;
+			m_multiply_boundary_kernel=&FBBlockPrivate::multiply_elements_by_A<true,true,true>;
+		}
+		else {
+			m_multiply_interior_kernel=&FBBlockPrivate::multiply_elements_by_A<true,false,false>;
+			m_multiply_boundary_kernel=&FBBlockPrivate::multiply_elements_by_A<true,true,false>;
+		}
+		m_diagonal_interior_kernel=&FBBlockPrivate::add_element_diagonals<true,false>;
+		m_diagonal_boundary_kernel=&FBBlockPrivate::add_element_diagonals<true,true>;
+	}
+	else {
+		if (interleaved) {
+			m_multiply_interior_kernel=&FBBlockPrivate::multiply_elements_by_A<false,false,true>;
+			m_multiply_boundary_kernel=&FBBlockPrivate::multiply_elements_by_A<false,true,true>;
+		}
+		else {
+			m_multiply_interior_kernel=&FBBlockPrivate::multiply_elements_by_A<false,false,false>;
+			m_multiply_boundary_kernel=&FBBlockPrivate::multiply_elements_by_A<false,true,false>;
+		}
+		m_diagonal_interior_kernel=&FBBlockPrivate::add_element_diagonals<false,false>;
+		m_diagonal_boundary_kernel=&FBBlockPrivate::add_element_diagonals<false,true>;
+	}
+}
+
+void FBBlockPrivate::update_element_factors() {
+	//the nonlinear adjustment only changes with the strains, so we evaluate it here rather than in every multiplication
+	//(the linear kernels use bvf/100 directly, so the arrays are only needed with a nonlinear adjuster)
+	if (!m_nonlinear_adjuster) {
+		m_element_strains.clear();
+		m_element_factors.clear();
+		return;
+	}
+	if (m_element_strains.count()!=m_elements.length()) m_element_strains.fill(0,m_elements.length());
+	m_element_factors.resize(m_elements.length());
+	for (long i=0; i<m_elements.length(); i++) {
+		const FBBlockElement *E0=&m_elements.ptr[i];
+		m_element_factors[i]=E0->bvf*1.0/100*m_nonlinear_adjuster->computeAdjustment(m_element_strains[i]);
 	}
-			
-	for (long i=0; i<m_elements.count(); i++) {
+}
+
+template <bool NONLINEAR,bool BOUNDARY,bool INTERLEAVED>
+void FBBlockPrivate::multiply_elements_by_A(FBBlockVector &Y,const FBBlockVector &X,long begin,long end) {
+	//the x+1 vertex of a row follows at S floats, see FBBlockVector
+	const long S=INTERLEAVED ? 12 : 3;
+	const float *stiffness_matrix_data=m_stiffness_data;
+	const FBBlockElement *elements=m_elements.ptr;
+	const float *factors=m_element_factors.constData();
+	for (long i=begin; i<end; i++) {
 		float X0[24];
 		float Y0[24];
-		long varinds[24];
-		FBBlockElement *E0=&m_elements[i];
-		{
-			{
-				for (int kk=0; kk<4; kk++) {
-					for (int jj=0; jj<6; jj++)
-						varinds[kk*6+jj]=E0->ref_indices[kk]+jj;
-				}
-				for (int kk=0; kk<24; kk++) {
-					X0[kk]=X.ptr[varinds[kk]];
-					Y0[kk]=0;
-				}
-			}
-			//optimized matrix multiplication
-			int ct=0;
-			for (int rr=0; rr<24; rr++)
-			for (int cc=0; cc<24; cc++) {
-				Y0[rr]+=stiffness_matrix_data[ct]*X0[cc];
-				ct++;
+		const FBBlockElement *E0=&elements[i];
+		long ref_indices[4];
+		element_ref_indices(i,ref_indices);
+		for (int kk=0; kk<4; kk++) {
+			const float *X1=&X.ptr[INTERLEAVED ? (ref_indices[kk]/3)*S : ref_indices[kk]];
+			for (int jj=0; jj<6; jj++) {
+				X0[kk*6+jj]=X1[(jj/3)*S+jj%3];
+				Y0[kk*6+jj]=0;
 			}
-			float bvf_factor=E0->bvf*1.0/100;
-			if (m_nonlinear_adjuster) bvf_factor*=m_nonlinear_adjuster->computeAdjustment(E0->strain);
-			//if ((i==0)&&(m_nonlinear_adjuster)) qDebug() << "The bvf factor is:" << bvf_factor << "for a strain of" << E0->strain;
-			for (int kk=0; kk<24; kk++) {
-				if (m_vertex_type.ptr[varinds[kk]]!=3) {
-					Y.ptr[varinds[kk]]+=Y0[kk]*bvf_factor;
+		}
+		//optimized matrix multiplication
+		int ct=0;
+		for (int rr=0; rr<24; rr++)
+		for (int cc=0; cc<24; cc++) {
+			Y0[rr]+=stiffness_matrix_data[ct]*X0[cc];
+			ct++;
+		}
+		float bvf_factor;
+		if (NONLINEAR) bvf_factor=factors[i];
+		else bvf_factor=E0->bvf*1.0/100;
+		for (int kk=0; kk<4; kk++) {
+			float *Y1=&Y.ptr[INTERLEAVED ? (ref_indices[kk]/3)*S : ref_indices[kk]];
+			for (int jj=0; jj<6; jj++) {
+				if ((!BOUNDARY)||(E0->owned_corners&(1<<(kk*2+jj/3)))) {
+					Y1[(jj/3)*S+jj%3]+=Y0[kk*6+jj]*bvf_factor;
 				}
 			}
 		}
 	}
+}
+
+void FBBlockPrivate::multiply_by_A(FBBlockVector &Y,const FBBlockVector &X) { //Y=AX
+	//the assembled operator does not know about the element strains, so it is only valid in the linear case
+	if ((m_operator_assembled)&&(!m_nonlinear_adjuster)) {
+		multiply_by_assembled_A(Y,X);
+		return;
+	}
 	
-	free(stiffness_matrix_data);
+	set_to_zero(Y);
+	if (m_team.threadCount()>1) {
+		run_on_tiles(TILE_OPERATION_MULTIPLY,&Y,&X);
+		return;
+	}
+	if (m_tiles.count()==1) {
+		(this->*m_multiply_interior_kernel)(Y,X,m_tiles[0].begin,m_tiles[0].boundary_begin);
+		(this->*m_multiply_boundary_kernel)(Y,X,m_tiles[0].boundary_begin,m_tiles[0].end);
+		return;
+	}
+	//tiled traversal: while working on one tile, prefetch the rows of the next one
+	for (int tt=0; tt<m_tiles.count(); tt++) {
+		const FBElementTile *T=&m_tiles[tt];
+		FBPrefetchCursor C;
+		start_prefetch(C,tt+1,&X,&Y);
+		for (long ii=T->begin; ii<T->boundary_begin; ii+=ELEMENTS_PER_PREFETCH_STEP) {
+			prefetch_next_lines(C);
+			(this->*m_multiply_interior_kernel)(Y,X,ii,qMin(ii+ELEMENTS_PER_PREFETCH_STEP,T->boundary_begin));
+		}
+		prefetch_next_lines(C);
+		(this->*m_multiply_boundary_kernel)(Y,X,T->boundary_begin,T->end);
+	}
 }
 
-void FBBlockPrivate::compute_preconditioner(const FBArray1D<float> &X,FBArray1D<float> &C) { 
-	for (long i=0; i<m_elements.count(); i++) {
-		FBBlockElement *E0=&m_elements[i];
-		long varinds[24];
-		for (int kk=0; kk<4; kk++) {
-			for (int jj=0; jj<6; jj++)
-				varinds[kk*6+jj]=E0->ref_indices[kk]+jj;
+void FBBlockPrivate::multiply_by_assembled_A(FBBlockVector &Y,const FBBlockVector &X) { //Y=AX
+	long num_vertices=m_num_variables/3;
+	const long *row_starts=m_bsr_row_starts.ptr;
+	const int *columns=m_bsr_columns.ptr;
+	const float *values=m_bsr_values.ptr;
+	const float *XX=X.ptr;
+	float *YY=Y.ptr;
+	long S=X.vertex_stride; //the same for Y
+	//rows of the outer interface are empty, so Y is zero there, as for the element products
+	for (long vv=0; vv<num_vertices; vv++) {
+		float y0=0,y1=0,y2=0;
+		for (long jj=row_starts[vv]; jj<row_starts[vv+1]; jj++) {
+			const float *B=&values[jj*9];
+			const float *X0=&XX[((long)columns[jj])*S];
+			y0+=B[0]*X0[0]+B[1]*X0[1]+B[2]*X0[2];
+			y1+=B[3]*X0[0]+B[4]*X0[1]+B[5]*X0[2];
+			y2+=B[6]*X0[0]+B[7]*X0[1]+B[8]*X0[2];
 		}
-		float X0[24];
-		float Y0[24];
-		float C0[24];
-		for (int kk=0; kk<24; kk++) {
-			if (!m_free.ptr[varinds[kk]])
-				X0[kk]=X.ptr[varinds[kk]];
-			else 
-				X0[kk]=0; 
-			Y0[kk]=0;
-			C0[kk]=0;
+		YY[vv*S]=y0;
+		YY[vv*S+1]=y1;
+		YY[vv*S+2]=y2;
+	}
+}
+
+inline int fb_popcount_27(long mask) {
+	int ret=0;
+	for (int kk=0; kk<27; kk++) ret+=(mask>>kk)&1;
+	return ret;
+}
+
+long FBBlockPrivate::vertex_coupling_mask(int xx,int yy,int zz) const {
+	//bit (ox+1)+3*(oy+1)+9*(oz+1) is set if the vertex (xx+ox,yy+oy,zz+oz) shares an element with (xx,yy,zz).
+	//The vertex is corner (a1,a2,a3) of the element (xx-a1,yy-a2,zz-a3), whose other corners are at offsets b-a.
+	long ret=0;
+	for (int aa=0; aa<8; aa++) {
+		if (!m_bvf_map.value(xx-aa%2,yy-(aa/2)%2,zz-aa/4)) continue;
+		for (int bb=0; bb<8; bb++) {
+			int offset=((bb%2)-(aa%2)+1)+3*(((bb/2)%2)-((aa/2)%2)+1)+9*((bb/4)-(aa/4)+1);
+			ret|=(1L<<offset);
 		}
+	}
+	return ret;
+}
+
+bool FBBlockPrivate::assemble_operator(int operator_mode,double memory_budget) {
+	m_operator_assembled=false;
+	m_bsr_row_starts.clear();
+	m_bsr_columns.clear();
+	m_bsr_values.clear();
+	if (operator_mode==OPERATOR_MODE_MATRIX_FREE) return false;
+	if ((operator_mode==OPERATOR_MODE_AUTO)&&(memory_budget<=0)) return false;
+	
+	long num_vertices=m_num_variables/3;
+	if (!num_vertices) return false;
+	if (num_vertices>0x7FFFFFFFL) return false; //the columns are ints
+	
+	//Each vertex couples to at most its 27 grid neighbors, the ones that share an element with it.
+	//We count them from the bvf map (without any table per vertex), so that the size of the BSR matrix is known
+	//before anything is allocated.
+	long num_blocks=0;
+	for (int zz=1; zz<=m_Nz; zz++)
+	for (int yy=1; yy<=m_Ny; yy++)
+	for (int xx=1; xx<=m_Nx; xx++) {
+		if (m_vertices.index(xx,yy,zz)>=0) num_blocks+=fb_popcount_27(vertex_coupling_mask(xx,yy,zz));
+	}
+	double required_bytes=num_blocks*(9*sizeof(float)+sizeof(int))+(num_vertices+1)*sizeof(long);
+	if ((operator_mode==OPERATOR_MODE_AUTO)&&(required_bytes>memory_budget)) {
+		return false;
+	}
+	
+	m_bsr_row_starts.allocate(num_vertices+1,&m_arena);
+	m_bsr_columns.allocate(num_blocks,&m_arena);
+	m_bsr_values.allocate(num_blocks*9,&m_arena);
+	FBArray1D<int> row_masks; //only while assembling, see below
+	row_masks.allocate(num_vertices);
+	if ((!m_bsr_row_starts.ptr)||(!m_bsr_columns.ptr)||(!m_bsr_values.ptr)||(!row_masks.ptr)) {
+		qWarning() << "Unable to allocate the assembled operator, using matrix-free multiplication.";
+		m_bsr_row_starts.clear();
+		m_bsr_columns.clear();
+		m_bsr_values.clear();
+		return false;
+	}
+	//the rows are in the order of the vertex indices (no rows on the outer interface), and the blocks of a row
+	//in the order of the neighbor offsets (ox+1)+3*(oy+1)+9*(oz+1), so the block of offset k in row vv is at
+	//row_starts[vv] plus the number of bits of the row's mask below k
+	for (long vv=0; vv<=num_vertices; vv++) m_bsr_row_starts.ptr[vv]=0;
+	for (int zz=1; zz<=m_Nz; zz++)
+	for (int yy=1; yy<=m_Ny; yy++)
+	for (int xx=1; xx<=m_Nx; xx++) {
+		long vv=m_vertices.index(xx,yy,zz);
+		if (vv<0) continue;
+		row_masks.ptr[vv]=(int)vertex_coupling_mask(xx,yy,zz);
+		m_bsr_row_starts.ptr[vv+1]=fb_popcount_27(row_masks.ptr[vv]);
+	}
+	for (long vv=0; vv<num_vertices; vv++) m_bsr_row_starts.ptr[vv+1]+=m_bsr_row_starts.ptr[vv];
+	for (int zz=1; zz<=m_Nz; zz++)
+	for (int yy=1; yy<=m_Ny; yy++)
+	for (int xx=1; xx<=m_Nx; xx++) {
+		long vv=m_vertices.index(xx,yy,zz);
+		if (vv<0) continue;
+		long mask=row_masks.ptr[vv];
+		long ct=m_bsr_row_starts.ptr[vv];
+		for (int kk=0; kk<27; kk++) {
+			if ((mask>>kk)&1) {
+				m_bsr_columns.ptr[ct]=(int)m_vertices.index(xx-1+kk%3,yy-1+(kk/3)%3,zz-1+kk/9);
+				ct++;
+			}
+		}
+	}
+	for (long ii=0; ii<num_blocks*9; ii++) m_bsr_values.ptr[ii]=0;
+	
+	//sum the weighted element stiffness matrices into the blocks
+	for (long i=0; i<m_elements.length(); i++) {
+		FBBlockElement *E0=&m_elements.ptr[i];
 		float bvf_factor=E0->bvf*1.0/100;
-		if (m_nonlinear_adjuster) bvf_factor*=m_nonlinear_adjuster->computeAdjustment(E0->strain);
-		for (int rr=0; rr<24; rr++) {
-			for (int cc=0; cc<24; cc++) {
-				Y0[rr]+=m_stiffness_matrix.value(rr,cc)*bvf_factor*X0[cc];
-				if (cc==rr) C0[rr]=m_stiffness_matrix.value(rr,cc)*bvf_factor;
+		long ref_indices[4];
+		element_ref_indices(i,ref_indices);
+		long corner_vertices[8];
+		for (int cc=0; cc<8; cc++) {
+			corner_vertices[cc]=ref_indices[(cc/2)%2+2*(cc/4)]/3+(cc%2);
+		}
+		for (int aa=0; aa<8; aa++) {
+			long va=corner_vertices[aa];
+			if (vertex_type(va*3)==VERTEX_TYPE_OUTER_INTERFACE) continue;
+			long row_start=m_bsr_row_starts.ptr[va];
+			long row_mask=row_masks.ptr[va];
+			for (int bb=0; bb<8; bb++) {
+				int offset=((bb%2)-(aa%2)+1)+3*(((bb/2)%2)-((aa/2)%2)+1)+9*((bb/4)-(aa/4)+1);
+				long pos=row_start+fb_popcount_27(row_mask&((1L<<offset)-1));
+				float *B=&m_bsr_values.ptr[pos*9];
+				for (int adir=0; adir<3; adir++)
+				for (int bdir=0; bdir<3; bdir++) {
+					B[adir*3+bdir]+=m_stiffness_matrix.value(aa*3+adir,bb*3+bdir)*bvf_factor;
+				}
 			}
 		}
-		for (int kk=0; kk<24; kk++) {
-			if ((m_vertex_type.ptr[varinds[kk]]!=3)&&(m_free.ptr[varinds[kk]])) {
-				C.ptr[varinds[kk]]+=C0[kk];
+	}
+	m_operator_assembled=true;
+	return true;
+}
+
+template <bool NONLINEAR,bool BOUNDARY>
+void FBBlockPrivate::add_element_diagonals(FBBlockVector &C,long begin,long end) {
+	const FBBlockElement *elements=m_elements.ptr;
+	for (long i=begin; i<end; i++) {
+		const FBBlockElement *E0=&elements[i];
+		float bvf_factor;
+		if (NONLINEAR) bvf_factor=m_element_factors[i];
+		else bvf_factor=E0->bvf*1.0/100;
+		long ref_indices[4];
+		element_ref_indices(i,ref_indices);
+		for (int kk=0; kk<4; kk++) {
+			for (int jj=0; jj<6; jj++) {
+				long varind=ref_indices[kk]+jj;
+				if (((!BOUNDARY)||(E0->owned_corners&(1<<(kk*2+jj/3))))&&(is_free(varind))) {
+					C[varind]+=m_stiffness_data[(kk*6+jj)*25]*bvf_factor;
+				}
 			}
 		}
-	}	
+	}
+}
+
+void FBBlockPrivate::compute_preconditioner(FBArray1D<float> &C) { 
+	//the preconditioner is always a contiguous array
+	FBBlockVector CV;
+	CV.ptr=C.ptr;
+	CV.vertex_stride=3;
+	if (m_team.threadCount()>1) {
+		run_on_tiles(TILE_OPERATION_DIAGONAL,&CV,0);
+		return;
+	}
+	for (int tt=0; tt<m_tiles.count(); tt++) {
+		(this->*m_diagonal_interior_kernel)(CV,m_tiles[tt].begin,m_tiles[tt].boundary_begin);
+		(this->*m_diagonal_boundary_kernel)(CV,m_tiles[tt].boundary_begin,m_tiles[tt].end);
+	}
+}
+
+double FBBlockPrivate::compute_element_energy(const long ref_indices[4],unsigned char bvf) {
+	float X0[24];
+	for (int kk=0; kk<4; kk++) {
+		const float *X1=m_x.vertex(ref_indices[kk]);
+		for (int jj=0; jj<6; jj++)
+			X0[kk*6+jj]=X1[(jj/3)*m_x.vertex_stride+jj%3];
+	}
+	//optimized matrix multiplication
+	double energy0=0;
+	int ct=0;
+	for (int rr=0; rr<24; rr++)
+	for (int cc=0; cc<24; cc++) {
+		energy0+=m_stiffness_data[ct]*X0[cc]*X0[rr];
+		ct++;
+	}
+	energy0*=bvf*1.0/100*(-1)*0.5;
+	return energy0;
 }
 
 float FBBlock::getDisplacement(int xx,int yy,int zz,int dd) {	
-	long varind=d->m_variable_indices.value(xx,yy,zz); 
+	long varind=d->variable_index(xx,yy,zz); 
 	if (varind>=0) varind+=dd;
 	else return 0;
-	return d->m_x.ptr[varind];	
+	return d->m_x[varind];	
 }
 float FBBlock::getForce(int xx,int yy,int zz,int dd) {	
-	long varind=d->m_variable_indices.value(xx,yy,zz); 
+	long varind=d->variable_index(xx,yy,zz); 
 	if (varind>=0) varind+=dd;
 	else return 0;
-	return d->m_r.ptr[varind];	
+	long ind=d->fixed_variable_position(varind);
+	if (ind>=0) return d->m_r_fixed.ptr[ind];
+	return d->m_r[varind];	
 }
 
 long FBBlock::ownedFreeVariableCount() {
-	long ret=0;
-	for (long i=0; i<d->m_free.length();i++)
-		if ((d->m_free.ptr[i])&&(d->m_vertex_type.ptr[i]!=3)) ret++;
+	return d->m_num_owned_variables-d->m_fixed_variables.count();
+}
+bool FBBlock::operatorIsAssembled() {
+	return d->m_operator_assembled;
+}
+long FBBlock::assembledOperatorBytes() {
+	if (!d->m_operator_assembled) return 0;
+	return d->m_bsr_row_starts.length()*sizeof(long)+d->m_bsr_columns.length()*sizeof(int)+d->m_bsr_values.length()*sizeof(float);
+}
+long FBBlock::memoryBytes() {
+	long ret=d->m_arena.bytesAllocated()+d->m_result_arena.bytesAllocated();
+	//the elements and their segments are in m_arena
+	ret+=(d->m_element_strains.count()+d->m_element_factors.count())*sizeof(float);
+	ret+=d->m_tiles.count()*sizeof(FBElementTile)+d->m_tile_spans.count()*sizeof(FBVariableSpan);
+	ret+=(d->m_fixed_variables.count()+d->m_inner_vertex_locations.count()+d->m_outer_vertex_locations.count())*sizeof(FBVertexLocation);
+	ret+=d->m_reaction_vertices.count()*sizeof(long)+d->m_reaction_coefficients.count()*sizeof(float);
+	ret+=d->m_vertices.memoryBytes();
+	ret+=((long)d->m_bvf_map.N1())*d->m_bvf_map.N2()*d->m_bvf_map.N3();
 	return ret;
 }
+void FBBlock::reconstructReactions() {
+	//r=-Ax on the fixed variables, as in initialize_residual (Ap is not needed again before the next step A)
+	if ((d->m_reactions_current)||(!d->m_num_variables)) return;
+	d->multiply_by_A(d->m_Ap,d->m_x);
+	for (long ii=0; ii<d->m_fixed_variables.count(); ii++) {
+		d->m_r_fixed.ptr[ii]=-d->m_Ap[d->m_fixed_variables[ii].ref_index];
+	}
+	d->m_reactions_current=true;
+}
+void FBBlock::prefetchArrays() {
+	d->m_arena.prefetch();
+	d->m_result_arena.prefetch();
+}
 long FBBlock::variableCount() {
 	return d->m_num_variables;
 }
 void FBBlock::clearArrays() {
-	d->m_free.clear();
-	d->m_Ap.clear();
-	d->m_p.clear();
-	d->m_vertex_type.clear();
+	d->m_vertex_flags.clear();
+	if (d->m_vector_layout==VECTOR_LAYOUT_SPLIT) {
+		//with the interleaved layout p and Ap go together with x and r, in clearArrays2
+		d->m_vector_storage[2].clear();
+		d->m_vector_storage[3].clear();
+		d->m_p.ptr=0;
+		d->m_Ap.ptr=0;
+	}
 	d->m_elements.clear();
+	d->m_element_segments.clear();
+	d->m_element_strains.clear();
+	d->m_element_factors.clear();
+	d->m_reaction_vertices.clear();
+	d->m_reaction_coefficients.clear();
+	d->m_lever_arms.clear();
+	d->m_fixed_lever_arms.clear();
+	d->m_tiles.clear();
+	d->m_tile_spans.clear();
+	for (int cc=0; cc<NUM_TILE_COLOURS; cc++) d->m_colour_tiles[cc].clear();
+	d->m_bsr_row_starts.clear();
+	d->m_bsr_columns.clear();
+	d->m_bsr_values.clear();
+	d->m_operator_assembled=false;
+	d->m_preconditioner.clear();
 	d->m_inner_vertex_locations.clear();
 	d->m_outer_vertex_locations.clear();
+	d->m_arena.release();
 }
 void FBBlock::clearArrays2() {
-	d->m_x.clear();
-	d->m_r.clear();
-	d->m_variable_indices.clear();
+	for (int i=0; i<4; i++) d->m_vector_storage[i].clear();
+	d->m_x.ptr=d->m_r.ptr=d->m_p.ptr=d->m_Ap.ptr=0;
+	d->m_r_fixed.clear();
+	d->m_Ap_fixed.clear();
+	d->m_fixed_variables.clear();
+	d->m_vertices.clear();
+	d->m_result_arena.release();
 }
 void FBBlock::setResolution(QList<float> &res) {
 	for (int i=0; i<3; i++) d->m_resolution[i]=res[i];
 }
+void FBBlockPrivate::setup_lever_arms() {
+	//the positions used by compute_stress, for accumulating the stress in step B
+	m_fixed_lever_arms.allocate(qMax(m_fixed_variables.count()*3,1),&m_arena);
+	for (long ii=0; ii<m_fixed_variables.count(); ii++) {
+		const FBVertexLocation *VL=&m_fixed_variables[ii];
+		m_fixed_lever_arms.ptr[ii*3+0]=(m_block_x_position+VL->x-1)*m_resolution[0];
+		m_fixed_lever_arms.ptr[ii*3+1]=(m_block_y_position+VL->y-1)*m_resolution[1];
+		m_fixed_lever_arms.ptr[ii*3+2]=(m_block_z_position+VL->z-1)*m_resolution[2];
+	}
+	if ((m_low_memory)||(m_stress_from_reactions)) return;
+	//zero on the outer interface, where r is zero anyway
+	m_lever_arms.allocate(m_num_variables,&m_arena);
+	for (int zz=1; zz<=m_Nz; zz++)
+	for (int yy=1; yy<=m_Ny; yy++)
+	for (int xx=1; xx<=m_Nx; xx++) {
+		long varind=variable_index(xx,yy,zz);
+		if (varind<0) continue;
+		m_lever_arms.ptr[varind+0]=(m_block_x_position+xx-1)*m_resolution[0];
+		m_lever_arms.ptr[varind+1]=(m_block_y_position+yy-1)*m_resolution[1];
+		m_lever_arms.ptr[varind+2]=(m_block_z_position+zz-1)*m_resolution[2];
+	}
+}
+
 QList<double> FBBlockPrivate::compute_stress() {
 	QList<double> ret;
 	for (int j=0; j<6; j++) ret << 0;
 	//was there a bug here? used to go up to i3<m_Nz+1
-	for (long i3=0; i3<m_Nz; i3++) 
+	//the forces on the free variables (r is zero on the fixed ones)
+	if (!m_stress_from_reactions) for (long i3=0; i3<m_Nz; i3++) 
 	for (long i2=0; i2<m_Ny; i2++) 
 	for (long i1=0; i1<m_Nx; i1++) {
-		float fx=q->getForce(i1+1,i2+1,i3+1,0);
-		float fy=q->getForce(i1+1,i2+1,i3+1,1);
-		float fz=q->getForce(i1+1,i2+1,i3+1,2);
+		long varind=variable_index(i1+1,i2+1,i3+1);
+		if (varind<0) continue;
+		const float *R=m_r.vertex(varind);
+		float fx=R[0];
+		float fy=R[1];
+		float fz=R[2];
 		if ((fx)||(fy)||(fz)) {
 			ret[0]+=fx*(m_block_x_position+i1)*m_resolution[0]; //sigma_11
 			ret[1]+=fy*(m_block_y_position+i2)*m_resolution[1]; //sigma_22
@@ -580,27 +1728,95 @@ QList<double> FBBlockPrivate::compute_stress() {
 			ret[5]+=(fy*(m_block_z_position+i3)*m_resolution[2]+fz*(m_block_y_position+i2)*m_resolution[1])*0.5; //sigma_23
 		}
 	}
+	//the reaction forces on the fixed variables
+	for (long ii=0; ii<m_fixed_variables.count(); ii++) {
+		const FBVertexLocation *VL=&m_fixed_variables[ii];
+		float ff=m_r_fixed.ptr[ii];
+		float px=(m_block_x_position+VL->x-1)*m_resolution[0];
+		float py=(m_block_y_position+VL->y-1)*m_resolution[1];
+		float pz=(m_block_z_position+VL->z-1)*m_resolution[2];
+		int dd=VL->ref_index%3;
+		if (dd==0) {
+			ret[0]+=ff*px;
+			ret[3]+=ff*py*0.5;
+			ret[4]+=ff*pz*0.5;
+		}
+		else if (dd==1) {
+			ret[1]+=ff*py;
+			ret[3]+=ff*px*0.5;
+			ret[5]+=ff*pz*0.5;
+		}
+		else {
+			ret[2]+=ff*pz;
+			ret[4]+=ff*px*0.5;
+			ret[5]+=ff*py*0.5;
+		}
+	}
 	return ret;
 }
 long FBBlock::ownedVariableCount() {
-	long ret=0;
-	for (long i=0; i<d->m_free.length();i++)
-		if (d->m_vertex_type.ptr[i]!=3) ret++;
-	return ret;
+	return d->m_num_owned_variables;
 }
 QList<double> FBBlock::getStress() {
 	return d->compute_stress();
 }
 
+struct FBGridTile {
+	int x0,y0,z0;
+	int nx,ny,nz;
+};
+
+//Computes the element energies of the grid tiles. The energies of a tile are collected first and
+//then written to the sparse array in one go, because the sparse array is not safe for concurrent writes.
+class FBEnergyMapTask : public FBWorkerTask {
+public:
+	FBBlockPrivate *block;
+	FBSparseArray4D *E;
+	QList<FBGridTile> tiles;
+	QAtomicInt next_tile;
+	QMutex mutex;
+	void run(int thread_index) {
+		Q_UNUSED(thread_index)
+		FBBlockPrivate *d=block;
+		QVector<float> energies;
+		while (true) {
+			int kk=next_tile.fetchAndAddOrdered(1);
+			if (kk>=tiles.count()) return;
+			FBGridTile T=tiles[kk];
+			energies.clear();
+			for (long zz=T.z0; zz<T.z0+T.nz; zz++)
+			for (long yy=T.y0; yy<T.y0+T.ny; yy++) {
+				if (d->m_tile_size>0) {
+					//the vertex rows needed by the next element row
+					d->prefetch_vertex_row(T.x0,T.x0+T.nx,yy+2,zz);
+					d->prefetch_vertex_row(T.x0,T.x0+T.nx,yy+2,zz+1);
+				}
+				for (long xx=T.x0; xx<T.x0+T.nx; xx++) {
+					if (is_element(d->m_bvf_map,xx,yy,zz)) {
+						long ref_indices[4];
+						ref_indices[0]=d->variable_index(xx,yy,zz);
+						ref_indices[1]=d->variable_index(xx,yy+1,zz);
+						ref_indices[2]=d->variable_index(xx,yy,zz+1);
+						ref_indices[3]=d->variable_index(xx,yy+1,zz+1);
+						energies << d->compute_element_energy(ref_indices,d->m_bvf_map.value(xx,yy,zz));
+					}
+				}
+			}
+			QMutexLocker locker(&mutex);
+			long ct=0;
+			for (long zz=T.z0; zz<T.z0+T.nz; zz++)
+			for (long yy=T.y0; yy<T.y0+T.ny; yy++)
+			for (long xx=T.x0; xx<T.x0+T.nx; xx++) {
+				if (is_element(d->m_bvf_map,xx,yy,zz)) {
+					E->setValue(energies[ct],0,xx,yy,zz);
+					ct++;
+				}
+			}
+		}
+	}
+};
+
 void FBBlock::computeEnergyMap(FBSparseArray4D &E) {
-	float *stiffness_matrix_data=(float *)malloc(sizeof(float)*24*24);
-	int ct=0;
-	for (int rr=0; rr<24; rr++)
-	for (int cc=0; cc<24; cc++) {
-		stiffness_matrix_data[ct]=d->m_stiffness_matrix.value(rr,cc);
-		ct++;
-	}	
-	
 	E.allocate(DATA_TYPE_FLOAT,1,d->m_Nx+1,d->m_Ny+1,d->m_Nz+1);
 	for (int pass=1; pass<=2; pass++) {
 		for (long i3=0; i3<d->m_Nz+1; i3++)
@@ -612,61 +1828,28 @@ void FBBlock::computeEnergyMap(FBSparseArray4D &E) {
 		}
 	}	
 	
-	for (long zz=0; zz<d->m_Nz+1; zz++)
-	for (long yy=0; yy<d->m_Ny+1; yy++)
-	for (long xx=0; xx<d->m_Nx+1; xx++)  {
-		if (is_element(d->m_bvf_map,xx,yy,zz)) {
-			fbreal bvf=d->m_bvf_map.value(xx,yy,zz);
-			long ref_indices[4];
-			ref_indices[0]=(long)d->m_variable_indices.value(xx,yy,zz);
-			ref_indices[1]=(long)d->m_variable_indices.value(xx,yy+1,zz);
-			ref_indices[2]=(long)d->m_variable_indices.value(xx,yy,zz+1);
-			ref_indices[3]=(long)d->m_variable_indices.value(xx,yy+1,zz+1);
-			
-			float X0[24];
-			long varinds[24];
-			{
-				for (int kk=0; kk<4; kk++) {
-					for (int jj=0; jj<6; jj++)
-						varinds[kk*6+jj]=ref_indices[kk]+jj;
-				}
-				for (int kk=0; kk<24; kk++) {
-					X0[kk]=d->m_x.ptr[varinds[kk]];
-				}
-			}
-			//optimized matrix multiplication
-			double energy0=0;
-			int ct=0;
-			for (int rr=0; rr<24; rr++)
-			for (int cc=0; cc<24; cc++) {
-				energy0+=stiffness_matrix_data[ct]*X0[cc]*X0[rr];
-				ct++;
-			}
-			energy0*=bvf*1.0/100*(-1)*0.5;
-			E.setValue(energy0,0,xx,yy,zz);
-			/*fbreal bvf=d->m_bvf_map.value(i1,i2,i3);
-			for (int a3=0; a3<=1; a3++)
-			for (int a2=0; a2<=1; a2++)
-			for (int a1=0; a1<=1; a1++) 
-			for (int adir=0; adir<3; adir++) {
-				long avarind=d->m_variable_indices.value(i1+a1,i2+a2,i3+a3)+adir;
-				for (int b3=0; b3<=1; b3++)
-				for (int b2=0; b2<=1; b2++)
-				for (int b1=0; b1<=1; b1++) 
-				for (int bdir=0; bdir<3; bdir++) {
-					long bvarind=d->m_variable_indices.value(i1+b1,i2+b2,i3+b3)+bdir;
-					float val0=d->m_x.ptr[bvarind]
-							*d->m_x.ptr[avarind]
-							*d->m_stiffness_matrix.value(adir+a1*3+a2*6+a3*12,bdir+b1*3+b2*6+b3*12)
-							*bvf/100*(-1);
-					E.setValue(
-							E.value(0,i1,i2,i3)+val0,
-							0,i1,i2,i3);
-				}
-			}*/
-		}
+	//The element list may already be cleared (see clearArrays), so we go through the grid,
+	//using the same tiles as multiply_by_A, shared among the threads of the block
+	FBEnergyMapTask task;
+	task.block=d;
+	task.E=&E;
+	task.next_tile=0;
+	int tile_size[3];
+	tile_size[0]=d->m_Nx+1; tile_size[1]=d->m_Ny+1; tile_size[2]=d->m_Nz+1;
+	if (d->m_tile_size>0) {
+		for (int i=0; i<3; i++) tile_size[i]=qMin(tile_size[i],d->m_tile_size);
 	}
-	free(stiffness_matrix_data);
+	for (int tz=0; tz<d->m_Nz+1; tz+=tile_size[2])
+	for (int ty=0; ty<d->m_Ny+1; ty+=tile_size[1])
+	for (int tx=0; tx<d->m_Nx+1; tx+=tile_size[0]) {
+		FBGridTile T;
+		T.x0=tx; T.y0=ty; T.z0=tz;
+		T.nx=qMin(tile_size[0],d->m_Nx+1-tx);
+		T.ny=qMin(tile_size[1],d->m_Ny+1-ty);
+		T.nz=qMin(tile_size[2],d->m_Nz+1-tz);
+		task.tiles << T;
+	}
+	d->m_team.run(&task);
 }
 int FBBlock::Nx() const {
 	return d->m_Nx;
@@ -687,6 +1870,12 @@ int FBBlock::zPosition() const {
 	return d->m_block_z_position;
 }
 void FBBlock::setNonlinearAdjuster(NonlinearAdjuster *X) {
+	if ((X)&&(d->m_low_memory)) {
+		qWarning() << "The nonlinear adjuster needs the element arrays, which are not kept in low-memory mode.";
+		return;
+	}
 	d->m_nonlinear_adjuster=X;
+	d->update_element_factors();
+	d->select_kernels();
 }
 
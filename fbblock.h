@@ -3,6 +3,7 @@
 
 #include "arrays.h"
 #include "nonlinearadjuster.h"
+#include <QString>
 
 /*
 
@@ -26,6 +27,19 @@ Total number of cells: (Nx+1)(Ny+1)(Nz+1)
 
 */
 
+//how the block applies its local operator in multiply_by_A
+#define OPERATOR_MODE_MATRIX_FREE 0 //recompute the 24x24 element products on every multiplication
+#define OPERATOR_MODE_ASSEMBLED 1 //assemble once into a 3x3-block sparse row (BSR) matrix
+#define OPERATOR_MODE_AUTO 2 //assemble only if the BSR matrix fits into operator_memory_budget
+
+//order in which setup() numbers the vertex rows (fixed y and z) of a block; each row stays contiguous in x
+#define VARIABLE_ORDERING_LEXICOGRAPHIC 0 //z-major, then y
+#define VARIABLE_ORDERING_MORTON 1 //rows follow a Morton (z-order) curve in (y,z), and so do the elements
+
+//how the CG vectors x, r, p and Ap of a block are stored
+#define VECTOR_LAYOUT_SPLIT 0 //four separate arrays
+#define VECTOR_LAYOUT_INTERLEAVED 1 //one array with the x, r, p and Ap triples of each vertex next to each other (12 floats per vertex)
+
 struct FBBlockSetupParameters {
 	//input
 	int Nx,Ny,Nz; //this block owns all vertices within a Nx x Ny x Nz grid
@@ -36,6 +50,16 @@ struct FBBlockSetupParameters {
 	float youngs_modulus;
 	float voxel_volume;
 	bool use_preconditioner;
+	int operator_mode; //OPERATOR_MODE_MATRIX_FREE, OPERATOR_MODE_ASSEMBLED or OPERATOR_MODE_AUTO
+	double operator_memory_budget; //bytes available to this block for the assembled operator (auto mode)
+	int variable_ordering; //VARIABLE_ORDERING_LEXICOGRAPHIC or VARIABLE_ORDERING_MORTON
+	int vector_layout; //VECTOR_LAYOUT_SPLIT or VECTOR_LAYOUT_INTERLEAVED
+	QString scratch_directory; //if not empty, the arrays of the block are kept in memory-mapped files in this directory (out-of-core solve)
+	bool low_memory; //keep only x, r and p; Ap and the preconditioner are recomputed vertex by vertex when needed (linear analysis only)
+	bool stress_from_reactions; //compute the stress from the reaction forces on the fixed variables only (which carry all of it at convergence)
+	bool eliminate_fixed_variables; //do not update the reaction forces in the iterations, see reconstructReactions (not in low-memory mode)
+	int tile_size; //edge length (in elements) of the tiles in which the elements are traversed, 0 for a single tile
+	int num_threads; //number of threads working on the element loops of this block (the tiles are coloured so they can run concurrently)
 	float resolution[3];
 	int block_x_position;
 	int block_y_position;
@@ -108,6 +132,11 @@ public:
 	long variableCount();
 	long ownedVariableCount();
 	long ownedFreeVariableCount();
+	bool operatorIsAssembled();
+	long assembledOperatorBytes();
+	long memoryBytes(); //storage of the block during the iterations
+	void prefetchArrays(); //with a scratch directory, starts reading the arrays back in, so that it overlaps with work on another block
+	void reconstructReactions(); //with eliminate_fixed_variables, computes the reaction forces (for getForce) from x; needs the element arrays
 	void clearArrays(); //clears all arrays, except for displacements, residuals and variable indices
 	void clearArrays2(); //clears displacements, residuals and variable indices
 	
@@ -19,5 +19,8 @@ SOURCES += fbglobal.cpp mda_io.cpp fbparameterfile.cpp fbsparsearray4d.cpp fbspa
 HEADERS += nonlinearadjuster.h
 SOURCES += nonlinearadjuster.cpp
 
+HEADERS += fbworkerteam.h fbvectorkernels.h fboccupancybitmap.h fbarena.h fbcputopology.h fbtaskgraph.h
+SOURCES += fbworkerteam.cpp fbvectorkernels.cpp fboccupancybitmap.cpp fbarena.cpp fbcputopology.cpp fbtaskgraph.cpp
+
 HEADERS += mda.h textfile.h
 SOURCES += mda.cpp textfile.cpp
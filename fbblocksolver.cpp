@@ -12,6 +12,16 @@
 #include "mda_io.h"
 #include "fbtimer.h"
 #include "nonlinearadjuster.h"
+#include "fboccupancybitmap.h"
+#include "fbcputopology.h"
+#include "fbtaskgraph.h"
+
+//relative cost of the work in an iteration, used to partition the volume into blocks
+//(operation counts of the matrix-free multiplication and the vector updates; the measured times take over when rebalancing)
+#define COST_PER_ELEMENT 576 //one 24x24 element product
+#define COST_PER_VERTEX 48 //the vector updates and inner products of the three variables
+#define COST_PER_HALO_VERTEX 6 //copying p to and from a neighbouring block
+#define REBALANCE_MIN_TIME 50 //ms; shorter measurements are left alone
 
 struct BlockInfo {
 	int xmin,xmax;
@@ -29,8 +39,19 @@ public:
 	float m_youngs_modulus;
 	float m_voxel_volume;
 	FBArray3D <unsigned char> m_bvf_map; //N1 x N2 x N3
+	FBOccupancyBitmap m_vertex_map; //(N1+1) x (N2+1) x (N3+1), the vertices of m_bvf_map (set up once in setBVFMap, instead of calling is_vertex)
 	FBSparseArray4D m_initial_displacements; //3x(N1+1)x(N2+1)x(N3+1)
 	FBSparseArray4D m_fixed_variables; //3x(N1+1)x(N2+1)x(N3+1)
+	//The fixed variables and initial displacements of a macroscopic strain are evaluated as the blocks are set up
+	//(see is_fixed and initial_value), so the global arrays above are only used when they are supplied directly.
+	bool m_fixed_from_strain;
+	FBMacroscopicStrain m_fixed_strain;
+	bool m_displacements_from_strain;
+	FBMacroscopicStrain m_displacement_strain;
+	fbreal m_displacement_resolution[3]; //the resolution when setInitialDisplacements was called
+	int m_free_displacements_type; //0 = none, 1 = m_free_displacements, 2 = m_free_displacements_dense
+	FBSparseArray4D m_free_displacements; //initial displacements given for the free variables, 3x(N1+1)x(N2+1)x(N3+1)
+	FBArray4D<float> m_free_displacements_dense;
 	QVector<FBBlock *> m_blocks;
 	long m_num_iterations;
 	FBErrorEstimator m_error_estimator;
@@ -42,11 +63,56 @@ public:
 	int m_max_iterations;
 	int m_num_threads;	
 	bool m_use_precondioner;
+	int m_operator_mode;
+	double m_operator_memory_budget; //bytes
+	int m_variable_ordering;
+	int m_vector_layout;
+	int m_tile_size;
+	int m_threads_per_block;
+	bool m_low_memory;
+	bool m_stress_from_reactions;
+	bool m_eliminate_fixed_variables;
+	QString m_scratch_directory;
+	int m_num_blocks;
+	int m_rebalance_iterations; //0 = never
+	QList<int> m_thread_cpus; //the CPUs the solver threads are pinned to (see thread_cpus), empty for no pinning
+	double m_rebalance_threshold;
 	float m_resolution[3];
 	
+	//cost model of the partition, per vertex plane z (see plane_cost and block_cost)
+	QList<long> m_slice_vertex_count; //N3+1 vertex planes
+	QList<long> m_slice_element_count; //N3 element layers
+	long m_total_vertex_count;
+	QList<double> m_plane_cost_factors; //measured over modelled cost, 1 until the first rebalancing
+	QVector<double> m_block_times; //ms spent by each block in steps A and B since it was set up
+	
+	FBTaskGraph m_task_graph; //the threads that set up and iterate the blocks, block i is always on thread i%m_num_threads
+	QList<FBGraphTask *> m_iteration_tasks; //see create_iteration_tasks
+	QList<FBGraphTask *> m_step_A_tasks,m_step_B_tasks;
+	FBGraphTask *m_reduce_task;
+	FBGraphTask *m_check_task;
+	int m_iteration_graph_type; //-1 when the graph must be rebuilt, see build_iteration_graph
+	int m_num_times_below_epsilon;
+	
 	NonlinearAdjuster *m_nonlinear_adjuster;
 	
 	void do_iterations();
+	bool is_fixed(int dd,long xx,long yy,long zz);
+	float initial_value(int dd,long xx,long yy,long zz);
+	void setup_block(FBBlock *B,BlockInfo *info,int tile_size,long block_vertex_count,long total_vertex_count); //extracts the inputs of the block and sets it up (called from the setup threads)
+	void setup_blocks();
+	double plane_cost(int z);
+	double block_cost(int zmin,int zmax);
+	int greedy_partition(double max_cost,QList<int> &zmax_list);
+	void partition_blocks(int num_blocks);
+	bool rebalance();
+	QList<int> thread_cpus(int thread_number);
+	void start_task_graph();
+	void create_iteration_tasks();
+	int add_step_A_tasks(const QList<int> &step_B_ids);
+	void build_iteration_graph(bool start_with_step_A,bool speculate);
+	QList<double> total_stress();
+	void check_convergence();
 };
 
 FBBlockSolver::FBBlockSolver() 
@@ -59,6 +125,27 @@ FBBlockSolver::FBBlockSolver()
 	d->m_max_iterations=0;
 	d->m_num_threads=1;
 	d->m_use_precondioner=false;
+	d->m_operator_mode=OPERATOR_MODE_AUTO;
+	d->m_operator_memory_budget=0;
+	d->m_variable_ordering=VARIABLE_ORDERING_LEXICOGRAPHIC;
+	d->m_vector_layout=VECTOR_LAYOUT_SPLIT;
+	d->m_tile_size=0;
+	d->m_threads_per_block=1;
+	d->m_low_memory=false;
+	d->m_stress_from_reactions=false;
+	d->m_eliminate_fixed_variables=false;
+	d->m_num_blocks=0;
+	d->m_rebalance_iterations=0;
+	d->m_rebalance_threshold=1.1;
+	d->m_total_vertex_count=0;
+	d->m_reduce_task=0;
+	d->m_check_task=0;
+	d->m_iteration_graph_type=-1;
+	d->m_num_times_below_epsilon=0;
+	d->m_fixed_from_strain=false;
+	d->m_displacements_from_strain=false;
+	d->m_free_displacements_type=0;
+	for (int i=0; i<3; i++) d->m_displacement_resolution[i]=1;
 	d->m_nonlinear_adjuster=0;
 	for (int i=0; i<3; i++) d->m_resolution[i]=1;
 	
@@ -67,6 +154,7 @@ FBBlockSolver::FBBlockSolver()
 
 FBBlockSolver::~FBBlockSolver()
 {
+	qDeleteAll(d->m_iteration_tasks);
 	qDeleteAll(d->m_blocks);
 	delete d;
 }
@@ -74,6 +162,22 @@ void FBBlockSolver::setEpsilon(fbreal epsilon) {d->m_epsilon=epsilon;}
 void FBBlockSolver::setMaxIterations(int val) {d->m_max_iterations=val;}
 void FBBlockSolver::setNumThreads(int val) {d->m_num_threads=val;}
 void FBBlockSolver::setUsePreconditioner(bool val) {d->m_use_precondioner=val;}
+void FBBlockSolver::setOperatorMode(int mode) {d->m_operator_mode=mode;}
+void FBBlockSolver::setOperatorMemoryBudget(double megabytes) {d->m_operator_memory_budget=megabytes*1024*1024;}
+void FBBlockSolver::setVariableOrdering(int ordering) {d->m_variable_ordering=ordering;}
+void FBBlockSolver::setVectorLayout(int layout) {d->m_vector_layout=layout;}
+void FBBlockSolver::setTileSize(int val) {d->m_tile_size=val;}
+void FBBlockSolver::setThreadsPerBlock(int val) {d->m_threads_per_block=val;}
+void FBBlockSolver::setLowMemory(bool val) {d->m_low_memory=val;}
+void FBBlockSolver::setStressFromReactions(bool val) {d->m_stress_from_reactions=val;}
+void FBBlockSolver::setEliminateFixedVariables(bool val) {d->m_eliminate_fixed_variables=val;}
+void FBBlockSolver::setScratchDirectory(const QString &path) {d->m_scratch_directory=path;}
+void FBBlockSolver::setNumBlocks(int val) {d->m_num_blocks=val;}
+void FBBlockSolver::setThreadCpus(const QList<int> &cpus) {d->m_thread_cpus=cpus;}
+void FBBlockSolver::setRebalancing(int num_iterations,double threshold) {
+	d->m_rebalance_iterations=num_iterations;
+	d->m_rebalance_threshold=threshold;
+}
 void FBBlockSolver::setStiffnessMatrix(const FBArray2D<float> &stiffness_matrix) {
 	d->m_stiffness_matrix=stiffness_matrix;
 }
@@ -85,34 +189,50 @@ void FBBlockSolver::setVoxelVolume(float val) {
 }
 void FBBlockSolver::setBVFMap(const FBArray3D<unsigned char> &bvf_map) {
 	d->m_bvf_map=bvf_map;
+	d->m_vertex_map.setFromElements(d->m_bvf_map);
 }
 void FBBlockSolver::setInitialDisplacementsOnFreeVariables(const FBSparseArray4D &displacements) {
-	d->m_initial_displacements.resetIteration();
-	while (d->m_initial_displacements.advanceIteration()) {
-		int i1=d->m_initial_displacements.currentIndex1();
-		int i2=d->m_initial_displacements.currentIndex2();
-		int i3=d->m_initial_displacements.currentIndex3();
-		int i4=d->m_initial_displacements.currentIndex4();
-		if (!d->m_fixed_variables.value(i1,i2,i3,i4)) {
-			d->m_initial_displacements.setValue(displacements.value(i1,i2,i3,i4),i1,i2,i3,i4);
-		}
-	}
+	d->m_free_displacements=displacements;
+	d->m_free_displacements_dense.clear();
+	d->m_free_displacements_type=1;
 }
 void FBBlockSolver::setInitialDisplacementsOnFreeVariables(const FBArray4D<float> &displacements) {
-	d->m_initial_displacements.resetIteration();
-	while (d->m_initial_displacements.advanceIteration()) {
-		int i1=d->m_initial_displacements.currentIndex1();
-		int i2=d->m_initial_displacements.currentIndex2();
-		int i3=d->m_initial_displacements.currentIndex3();
-		int i4=d->m_initial_displacements.currentIndex4();
-		if (!d->m_fixed_variables.value(i1,i2,i3,i4)) {
-			d->m_initial_displacements.setValue(displacements.value(i1,i2,i3,i4),i1,i2,i3,i4);
-		}
-	}
+	d->m_free_displacements_dense=displacements;
+	FBSparseArray4D empty;
+	d->m_free_displacements.swap(empty);
+	d->m_free_displacements_type=2;
 }
 
 void FBBlockSolver::setFixedVariables(const FBSparseArray4D &fixed_variables) {
 	d->m_fixed_variables=fixed_variables;
+	d->m_fixed_from_strain=false;
+}
+
+bool FBBlockSolverPrivate::is_fixed(int dd,long xx,long yy,long zz) {
+	if (!m_fixed_from_strain) return (m_fixed_variables.value(dd,xx,yy,zz)!=0);
+	//a restricted face fixes its vertices in the restricted directions
+	long pos[3]={xx,yy,zz};
+	long N[3]={m_bvf_map.N1(),m_bvf_map.N2(),m_bvf_map.N3()};
+	for (int i=0; i<3; i++) {
+		if ((pos[i]<0)||(pos[i]>N[i])) return false;
+	}
+	for (int face=0; face<3; face++) {
+		if (((pos[face]==0)||(pos[face]==N[face]))&&(m_fixed_strain.boundaryRestrictions[face][dd])) return true;
+	}
+	return false;
+}
+
+float FBBlockSolverPrivate::initial_value(int dd,long xx,long yy,long zz) {
+	if ((m_free_displacements_type)&&(!is_fixed(dd,xx,yy,zz))) {
+		if (m_free_displacements_type==1) return m_free_displacements.value(dd,xx,yy,zz);
+		if ((xx>=0)&&(xx<m_free_displacements_dense.N2())&&(yy>=0)&&(yy<m_free_displacements_dense.N3())&&(zz>=0)&&(zz<m_free_displacements_dense.N4())) {
+			return m_free_displacements_dense.value(dd,xx,yy,zz);
+		}
+		return 0;
+	}
+	if (!m_displacements_from_strain) return m_initial_displacements.value(dd,xx,yy,zz);
+	if ((xx<0)||(xx>m_bvf_map.N1())||(yy<0)||(yy>m_bvf_map.N2())||(zz<0)||(zz>m_bvf_map.N3())) return 0;
+	return initial_displacement(xx,yy,zz,dd,m_displacement_resolution,m_displacement_strain);
 }
 
 bool is_on_an_interface(long x,long y,long z,int block_size) {
@@ -128,32 +248,172 @@ bool is_on_an_interface(long x,long y,long z,int block_size) {
 	return false;
 }
 
-class FBBlockSolverThread : public QThread {
+//The tasks of an iteration (see build_iteration_graph)
+class FBStepATask : public FBGraphTask {
+public:
+	FBBlock *block;
+	FBBlock *next_block; //the next block on the same thread, or 0
+	FBBlockIterateStepAParameters *params;
+	BlockInfo *top_neighbour,*bottom_neighbour; //0 at the ends
+	double *block_time;
+	void run() {
+		//read ahead the next block while working on this one (only does something for blocks in scratch files)
+		if (next_block) next_block->prefetchArrays();
+		//receive the halo
+		if (top_neighbour) params->p_on_top_outer_interface=top_neighbour->p_on_bottom_inner_interface;
+		if (bottom_neighbour) params->p_on_bottom_outer_interface=bottom_neighbour->p_on_top_inner_interface;
+		QTime timer; timer.start();
+		block->iterate_step_A(*params);
+		*block_time+=timer.elapsed();
+	}
+};
+
+class FBReduceTask : public FBGraphTask {
 public:
 	QList<FBBlockIterateStepAParameters *> step_A_parameters;
 	QList<FBBlockIterateStepBParameters *> step_B_parameters;
-	QList<FBBlock *> blocks;
-	bool do_step_A;
-	bool do_step_B;
-	
-	FBBlockSolverThread() {
-		do_step_A=false;
-		do_step_B=false;
-	}
+	int WN[3];
 	void run() {
-		if (do_step_A) {
-			for (int i=0; i<blocks.count(); i++) {
-				blocks[i]->iterate_step_A(*(step_A_parameters[i]));
-			}
+		double r_Ap=0;
+		double p_Ap=0;
+		double Ap_Ap=0;
+		double r_z=0;
+		for (int i=0; i<step_A_parameters.count(); i++) {
+			r_z+=step_A_parameters[i]->r_z;
+			r_Ap+=step_A_parameters[i]->r_Ap;
+			p_Ap+=step_A_parameters[i]->p_Ap;
+			Ap_Ap+=step_A_parameters[i]->Ap_Ap;
 		}
-		else if (do_step_B) {
-			for (int i=0; i<blocks.count(); i++) {
-				blocks[i]->iterate_step_B(*(step_B_parameters[i]));
-			}
+		for (int i=0; i<step_B_parameters.count(); i++) {
+			FBBlockIterateStepBParameters *PP=step_B_parameters[i];
+			PP->alpha=r_z/p_Ap; 
+			if (r_z!=0) PP->beta=(r_z-2*PP->alpha*r_Ap+PP->alpha*PP->alpha*Ap_Ap)/r_z;
+			else PP->beta=0;
+			for (int j=0; j<3; j++) PP->WN[j]=WN[j];
 		}
 	}
 };
 
+class FBStepBTask : public FBGraphTask {
+public:
+	FBBlock *block;
+	FBBlock *next_block;
+	FBBlockIterateStepBParameters *params;
+	BlockInfo *info;
+	double *block_time;
+	void run() {
+		if (next_block) next_block->prefetchArrays();
+		QTime timer; timer.start();
+		block->iterate_step_B(*params);
+		*block_time+=timer.elapsed();
+		//send the halo
+		info->p_on_top_inner_interface=params->p_on_top_inner_interface;
+		info->p_on_bottom_inner_interface=params->p_on_bottom_inner_interface;
+	}
+};
+
+class FBCheckTask : public FBGraphTask {
+public:
+	FBBlockSolverPrivate *solver;
+	void run() {
+		solver->check_convergence();
+	}
+};
+
+class FBReactionTask : public FBGraphTask {
+public:
+	FBBlock *block;
+	void run() {
+		block->reconstructReactions();
+	}
+};
+
+class FBSetupTask : public FBGraphTask {
+public:
+	FBBlockSolverPrivate *solver;
+	FBBlock *block;
+	BlockInfo *info;
+	long block_vertex_count;
+	int tile_size;
+	long total_vertex_count;
+	void run() {
+		solver->setup_block(block,info,tile_size,block_vertex_count,total_vertex_count);
+	}
+};
+
+void FBBlockSolverPrivate::setup_block(FBBlock *B,BlockInfo *info,int tile_size,long block_vertex_count,long total_vertex_count) {
+	FBBlockSetupParameters PP;
+	PP.use_preconditioner=m_use_precondioner;
+	BlockInfo Info0=*info;
+	PP.operator_mode=m_operator_mode;
+	PP.variable_ordering=m_variable_ordering;
+	PP.vector_layout=m_vector_layout;
+	PP.low_memory=m_low_memory;
+	PP.stress_from_reactions=m_stress_from_reactions;
+	PP.eliminate_fixed_variables=m_eliminate_fixed_variables;
+	PP.scratch_directory=m_scratch_directory;
+	PP.tile_size=tile_size;
+	PP.num_threads=m_threads_per_block;
+	PP.operator_memory_budget=0;
+	if (total_vertex_count) PP.operator_memory_budget=m_operator_memory_budget*block_vertex_count/total_vertex_count;
+	for (int i=0; i<3; i++) PP.resolution[i]=m_resolution[i];
+	PP.Nx=Info0.xmax-Info0.xmin+1;
+	PP.Ny=Info0.ymax-Info0.ymin+1;
+	PP.Nz=Info0.zmax-Info0.zmin+1;
+	PP.block_x_position=Info0.xmin;
+	PP.block_y_position=Info0.ymin;
+	PP.block_z_position=Info0.zmin; 
+	//BVF
+	PP.BVF.allocate(PP.Nx+1,PP.Ny+1,PP.Nz+1);
+	for (int zz=Info0.zmin-1; zz<Info0.zmax+1; zz++)
+	for (int yy=Info0.ymin-1; yy<Info0.ymax+1; yy++)
+	for (int xx=Info0.xmin-1; xx<Info0.xmax+1; xx++) {
+		int xx0=xx-(Info0.xmin-1); int yy0=yy-(Info0.ymin-1); int zz0=zz-(Info0.zmin-1);
+		unsigned char val=m_bvf_map.value(xx,yy,zz);
+		PP.BVF.setValue(val,xx0,yy0,zz0);
+	}
+	//fixed variables
+	PP.fixed.allocate(PP.Nx+2,PP.Ny+2,PP.Nz+2,3);
+	for (int zz=Info0.zmin-1; zz<=Info0.zmax+1; zz++)
+	for (int yy=Info0.ymin-1; yy<=Info0.ymax+1; yy++)	
+	for (int xx=Info0.xmin-1; xx<=Info0.xmax+1; xx++)
+	for (int dd=0; dd<3; dd++) {
+		int xx0=xx-(Info0.xmin-1); int yy0=yy-(Info0.ymin-1); int zz0=zz-(Info0.zmin-1);
+		if (is_fixed(dd,xx,yy,zz)) {
+			PP.fixed.setValue(1,xx0,yy0,zz0,dd);
+		}
+	}
+	//stiffness_matrix
+	PP.stiffness_matrix=m_stiffness_matrix;
+	PP.youngs_modulus=m_youngs_modulus;
+	PP.voxel_volume=m_voxel_volume;
+
+	//Initial displacements		
+	PP.X0.allocate(PP.Nx+2,PP.Ny+2,PP.Nz+2,3);
+	for (int zz=Info0.zmin-1; zz<=Info0.zmax+1; zz++)
+	for (int yy=Info0.ymin-1; yy<=Info0.ymax+1; yy++)	
+	for (int xx=Info0.xmin-1; xx<=Info0.xmax+1; xx++)
+	for (int dd=0; dd<3; dd++) {
+		int xx0=xx-(Info0.xmin-1); int yy0=yy-(Info0.ymin-1); int zz0=zz-(Info0.zmin-1);
+		PP.X0.setValue(initial_value(dd,xx,yy,zz),xx0,yy0,zz0,dd);
+	}
+	//setup
+	B->setup(PP);
+	/*//set m_p on inner interfaces
+	PP.p_on_inner_interface.resetIteration();
+	while (PP.p_on_inner_interface.advanceIteration()) {
+		int dd0=PP.p_on_inner_interface.currentIndex1();
+		int xx0=PP.p_on_inner_interface.currentIndex2();
+		int yy0=PP.p_on_inner_interface.currentIndex3();
+		int zz0=PP.p_on_inner_interface.currentIndex4();			
+		float val0=PP.p_on_inner_interface.currentValue();
+		m_p.setValue(val0,dd0,Info0.xmin-1+xx0,Info0.ymin-1+yy0,Info0.zmin-1+zz0);
+	}*/
+	//the interface values of the block are kept with its info
+	info->p_on_top_inner_interface=PP.p_on_top_inner_interface;
+	info->p_on_bottom_inner_interface=PP.p_on_bottom_inner_interface;
+}
+
 bool is_on_an_interface(long x,long y,long z,const QList<BlockInfo> &infos) {
 	for (int i=0; i<infos.count(); i++) {
 		BlockInfo II=infos[i];
@@ -169,156 +429,366 @@ bool is_on_an_interface(long x,long y,long z,const QList<BlockInfo> &infos) {
 
 void FBBlockSolver::solve() {
 	FBTimer::startTimer("solve");
+	if ((d->m_low_memory)&&(d->m_eliminate_fixed_variables)) {
+		printf("The fixed variables are not eliminated in low-memory mode.\n");
+		d->m_eliminate_fixed_variables=false;
+	}
 	
 	FBTimer::startTimer("setup");
-	//number of blocks needed = (Nx) x (Ny) x (Nz)
 	int N1=d->m_bvf_map.N1();
 	int N2=d->m_bvf_map.N2();
 	int N3=d->m_bvf_map.N3();
 	
-	QList<long> slice_vertex_count;
-	long total_vertex_count=0;
+	d->m_slice_vertex_count.clear();
+	d->m_total_vertex_count=0;
+	d->m_plane_cost_factors.clear();
 	for (int z=0; z<N3+1; z++) {
-		long vertex_count=0;
-		for (int y=0; y<N2+1; y++)
-		for (int x=0; x<N1+1; x++) {
-			if (is_vertex(d->m_bvf_map,x,y,z)) {
-				vertex_count++;
-				total_vertex_count++;
-			}
+		long vertex_count=d->m_vertex_map.sliceCount(z);
+		d->m_total_vertex_count+=vertex_count;
+		d->m_slice_vertex_count << vertex_count;
+		d->m_plane_cost_factors << 1;
+	}
+	d->m_slice_element_count.clear();
+	for (int z=0; z<N3; z++) {
+		long element_count=0;
+		for (int y=0; y<N2; y++)
+		for (int x=0; x<N1; x++)
+			if (d->m_bvf_map.value(x,y,z)) element_count++;
+		d->m_slice_element_count << element_count;
+	}
+
+	d->partition_blocks(qMax(d->m_num_blocks,d->m_num_threads));
+	d->setup_blocks();
+	FBTimer::stopTimer("setup");
+
+	d->do_iterations();
+	
+	FBTimer::stopTimer("solve");
+}
+
+QList<int> FBBlockSolverPrivate::thread_cpus(int thread_number) {
+	//solver thread i and the worker threads of its blocks share m_threads_per_block consecutive cpus of m_thread_cpus
+	QList<int> ret;
+	if (m_thread_cpus.isEmpty()) return ret;
+	int num=qMax(m_threads_per_block,1);
+	for (int j=0; j<num; j++) ret << m_thread_cpus[(thread_number*num+j)%m_thread_cpus.count()];
+	return ret;
+}
+
+void FBBlockSolverPrivate::start_task_graph() {
+	m_task_graph.setThreadCount(m_num_threads);
+	for (int i=0; i<m_num_threads; i++) m_task_graph.setThreadCpus(i,thread_cpus(i));
+}
+
+void FBBlockSolverPrivate::create_iteration_tasks() {
+	m_task_graph.clear();
+	qDeleteAll(m_iteration_tasks);
+	m_iteration_tasks.clear();
+	m_step_A_tasks.clear();
+	m_step_B_tasks.clear();
+	m_iteration_graph_type=-1;
+	int num_blocks=m_blocks.count();
+	FBReduceTask *R=new FBReduceTask;
+	R->WN[0]=m_bvf_map.N1();
+	R->WN[1]=m_bvf_map.N2();
+	R->WN[2]=m_bvf_map.N3();
+	for (int i=0; i<num_blocks; i++) {
+		FBBlock *next_block=0;
+		if (i+m_num_threads<num_blocks) next_block=m_blocks[i+m_num_threads];
+		FBStepATask *A=new FBStepATask;
+		A->block=m_blocks[i];
+		A->next_block=next_block;
+		A->params=&m_PPP_A[i];
+		A->top_neighbour=0; A->bottom_neighbour=0;
+		if (i-1>=0) A->top_neighbour=&m_block_infos[i-1];
+		if (i+1<num_blocks) A->bottom_neighbour=&m_block_infos[i+1];
+		A->block_time=&m_block_times[i];
+		m_step_A_tasks << A;
+		FBStepBTask *B=new FBStepBTask;
+		B->block=m_blocks[i];
+		B->next_block=next_block;
+		B->params=&m_PPP_B[i];
+		B->info=&m_block_infos[i];
+		B->block_time=&m_block_times[i];
+		m_step_B_tasks << B;
+		R->step_A_parameters << &m_PPP_A[i];
+		R->step_B_parameters << &m_PPP_B[i];
+	}
+	FBCheckTask *C=new FBCheckTask;
+	C->solver=this;
+	m_reduce_task=R;
+	m_check_task=C;
+	m_iteration_tasks << m_step_A_tasks << m_step_B_tasks << R << C;
+}
+
+int FBBlockSolverPrivate::add_step_A_tasks(const QList<int> &step_B_ids) {
+	//step A of a block needs its own p and the halo of its neighbours from step B (when step B is in the same graph),
+	//the reduction needs the products of all blocks. Each block stays on the same thread. Returns the id of the reduction.
+	int num_blocks=m_blocks.count();
+	QList<int> step_A_ids;
+	for (int i=0; i<num_blocks; i++) {
+		step_A_ids << m_task_graph.addTask(m_step_A_tasks[i],i%m_num_threads);
+		if (!step_B_ids.isEmpty()) {
+			for (int j=qMax(i-1,0); j<=qMin(i+1,num_blocks-1); j++) m_task_graph.addDependency(step_B_ids[j],step_A_ids[i]);
 		}
-		slice_vertex_count << vertex_count;
 	}
+	int reduce_id=m_task_graph.addTask(m_reduce_task);
+	for (int i=0; i<num_blocks; i++) {
+		m_task_graph.addDependency(step_A_ids[i],reduce_id);
+	}
+	return reduce_id;
+}
 
-	d->m_block_infos.clear();
-	double num_vertices_per_thread=((double)total_vertex_count)*1.0/d->m_num_threads;
+void FBBlockSolverPrivate::build_iteration_graph(bool start_with_step_A,bool speculate) {
+	//One iteration is step A (unless the previous run did it speculatively), the reduction, step B and the convergence
+	//check. When speculating, step A and the reduction of the next iteration run as well, concurrently with the check,
+	//so the check is off the critical path. Step A does not change x or r (linear analysis), so if the check finds
+	//convergence, the speculative work is simply discarded.
+	int type=(start_with_step_A?1:0)+(speculate?2:0);
+	if (type==m_iteration_graph_type) return;
+	m_task_graph.clear();
+	m_iteration_graph_type=type;
+	int num_blocks=m_blocks.count();
+	int reduce_id=-1;
+	if (start_with_step_A) reduce_id=add_step_A_tasks(QList<int>());
+	QList<int> step_B_ids;
+	for (int i=0; i<num_blocks; i++) {
+		step_B_ids << m_task_graph.addTask(m_step_B_tasks[i],i%m_num_threads);
+		if (reduce_id>=0) m_task_graph.addDependency(reduce_id,step_B_ids[i]);
+	}
+	int check_id=m_task_graph.addTask(m_check_task);
+	for (int i=0; i<num_blocks; i++) {
+		m_task_graph.addDependency(step_B_ids[i],check_id);
+	}
+	if (speculate) add_step_A_tasks(step_B_ids);
+}
+
+double FBBlockSolverPrivate::plane_cost(int z) {
+	//the elements on either side of the plane are shared with the neighbouring planes
+	double ret=COST_PER_VERTEX*m_slice_vertex_count.value(z);
+	ret+=COST_PER_ELEMENT*(m_slice_element_count.value(z-1)+m_slice_element_count.value(z))/2;
+	return ret*m_plane_cost_factors.value(z,1);
+}
+
+double FBBlockSolverPrivate::block_cost(int zmin,int zmax) {
+	//the block owns the vertex planes zmin..zmax, but also does the element layers zmin-1 and zmax
+	//completely, and exchanges the planes zmin-1 and zmax+1 with its neighbours
+	double ret=0;
+	for (int z=zmin; z<=zmax; z++) ret+=plane_cost(z);
+	ret+=(COST_PER_ELEMENT*m_slice_element_count.value(zmin-1)/2+COST_PER_HALO_VERTEX*m_slice_vertex_count.value(zmin-1))*m_plane_cost_factors.value(zmin,1);
+	ret+=(COST_PER_ELEMENT*m_slice_element_count.value(zmax)/2+COST_PER_HALO_VERTEX*m_slice_vertex_count.value(zmax+1))*m_plane_cost_factors.value(zmax,1);
+	return ret;
+}
+
+int FBBlockSolverPrivate::greedy_partition(double max_cost,QList<int> &zmax_list) {
+	//makes each block as long as possible without exceeding max_cost (but at least one plane); returns the number of blocks
+	int N3=m_bvf_map.N3();
+	zmax_list.clear();
+	int zmin=0;
+	while (zmin<=N3) {
+		int zmax=zmin;
+		while ((zmax<N3)&&(block_cost(zmin,zmax+1)<=max_cost)) zmax++;
+		zmax_list << zmax;
+		zmin=zmax+1;
+	}
+	return zmax_list.count();
+}
+
+void FBBlockSolverPrivate::partition_blocks(int num_blocks) {
+	//z-slabs that minimize the cost of the most expensive block (bisection on that cost), rather than
+	//filling the blocks one after the other, which leaves the accumulated error to the last block
+	int N1=m_bvf_map.N1();
+	int N2=m_bvf_map.N2();
+	int N3=m_bvf_map.N3();
+	num_blocks=qMax(1,qMin(num_blocks,N3+1));
+	
+	QList<int> zmax_list;
+	double lower=0,upper=block_cost(0,N3);
+	for (int it=0; it<60; it++) {
+		double mid=(lower+upper)/2;
+		if (greedy_partition(mid,zmax_list)<=num_blocks) upper=mid;
+		else lower=mid;
+	}
+	greedy_partition(upper,zmax_list);
+	//the bottleneck may be reached with fewer blocks, in which case the most expensive ones are split so that all threads have work
+	while (zmax_list.count()<num_blocks) {
+		int ibest=-1; double best_cost=0;
+		for (int i=0; i<zmax_list.count(); i++) {
+			int zmin=0; if (i>0) zmin=zmax_list[i-1]+1;
+			if (zmax_list[i]>zmin) {
+				double cost=block_cost(zmin,zmax_list[i]);
+				if ((ibest<0)||(cost>best_cost)) {ibest=i; best_cost=cost;}
+			}
+		}
+		if (ibest<0) break;
+		int zmin=0; if (ibest>0) zmin=zmax_list[ibest-1]+1;
+		int zsplit=zmin;
+		while ((zsplit+1<zmax_list[ibest])&&(block_cost(zmin,zsplit+1)<=block_cost(zsplit+2,zmax_list[ibest]))) zsplit++;
+		zmax_list.insert(ibest,zsplit);
+	}
+	
+	m_block_infos.clear();
 	int z0=-1;
-	for (int ithread=0; ithread<d->m_num_threads; ithread++) {
+	for (int iblock=0; iblock<zmax_list.count(); iblock++) {
 		BlockInfo block_info0;
 		block_info0.xmin=-1; block_info0.xmax=N1+1;
 		block_info0.ymin=-1; block_info0.ymax=N2+1;
 		block_info0.zmin=z0+1;
-		if (ithread==d->m_num_threads-1) {
-			block_info0.zmax=N3;
-		}
-		else {
-			int zmax=z0+1;
-			if (zmax<N3+1) {
-				long block_vertex_count=slice_vertex_count[zmax];
-				bool done=false;
-				while (!done) {
-					if (zmax>=N3) done=true;
-					else {
-						double diff0=qAbs(block_vertex_count-num_vertices_per_thread);
-						zmax++;
-						if (zmax<=N3) block_vertex_count+=slice_vertex_count[zmax];
-						double diff1=qAbs(block_vertex_count-num_vertices_per_thread);
-						if (diff1>=diff0) {
-							zmax--;
-							done=true;
-						}
-					}
-				}
-			}
-			block_info0.zmax=zmax;
-			z0=block_info0.zmax;
-		}
-		if (block_info0.zmin<=N3) d->m_block_infos << block_info0;
+		block_info0.zmax=zmax_list[iblock];
+		z0=block_info0.zmax;
+		m_block_infos << block_info0;
+	}
+}
+
+bool FBBlockSolverPrivate::rebalance() {
+	if ((m_low_memory)&&((!m_fixed_from_strain)||(!m_displacements_from_strain))) {
+		//the global boundary arrays were released after the setup
+		printf("Rebalancing is not available in low-memory mode with explicit boundary conditions.\n");
+		return false;
 	}
+	QVector<double> thread_times(m_num_threads,0);
+	double total_time=0;
+	for (int i=0; i<m_blocks.count(); i++) {
+		thread_times[i%m_num_threads]+=m_block_times[i];
+		total_time+=m_block_times[i];
+	}
+	double max_time=0;
+	for (int i=0; i<m_num_threads; i++) max_time=qMax(max_time,thread_times[i]);
+	if (total_time<REBALANCE_MIN_TIME) {
+		printf("Not rebalancing: %g ms is too short to compare the blocks.\n",total_time);
+		return false;
+	}
+	double imbalance=max_time/(total_time/m_num_threads);
+	printf("Load imbalance after %ld iterations: %.2f (slowest thread / mean).\n",m_num_iterations,imbalance);
+	if (imbalance<=m_rebalance_threshold) return false;
 	
-	qDeleteAll(d->m_blocks);
-	d->m_blocks.clear();
+	//scale the modelled cost of the planes of each block so that the block costs match the measured times
+	for (int i=0; i<m_block_infos.count(); i++) {
+		int zmin=qMax(m_block_infos[i].zmin,0);
+		int zmax=qMin(m_block_infos[i].zmax,(int)m_bvf_map.N3());
+		double model=block_cost(zmin,zmax);
+		if (model<=0) continue;
+		double factor=qMax(m_block_times[i],1.0)/model;
+		for (int z=zmin; z<=zmax; z++) m_plane_cost_factors[z]*=factor;
+	}
+	QList<BlockInfo> old_infos=m_block_infos;
+	partition_blocks(m_blocks.count());
+	bool changed=(old_infos.count()!=m_block_infos.count());
+	for (int i=0; (i<old_infos.count())&&(!changed); i++) {
+		if ((old_infos[i].zmin!=m_block_infos[i].zmin)||(old_infos[i].zmax!=m_block_infos[i].zmax)) changed=true;
+	}
+	if (!changed) {
+		m_block_infos=old_infos;
+		m_block_times.fill(0);
+		return false;
+	}
+	
+	//set up the new blocks from the current displacements (CG restarts from there)
+	printf("Repartitioning the blocks...\n");
+	FBArray4D<float> X;
+	q->getDisplacements(X);
+	int old_type=m_free_displacements_type;
+	FBArray4D<float> old_dense=m_free_displacements_dense;
+	m_free_displacements_type=2;
+	m_free_displacements_dense=X;
+	setup_blocks();
+	m_free_displacements_dense=old_dense;
+	m_free_displacements_type=old_type;
+	return true;
+}
+
+void FBBlockSolverPrivate::setup_blocks() {
+	qDeleteAll(m_blocks);
+	m_blocks.clear();
 	
-	//Set up the blocks and d->m_p
-	/*d->m_p.allocate(DATA_TYPE_FLOAT,3,d->m_bvf_map.N1()+1,d->m_bvf_map.N2()+1,d->m_bvf_map.N3()+1);
+	//Set up the blocks and m_p
+	/*m_p.allocate(DATA_TYPE_FLOAT,3,m_bvf_map.N1()+1,m_bvf_map.N2()+1,m_bvf_map.N3()+1);
 	for (int pass=1; pass<=2; pass++) {
-		for (long z=0; z<d->m_bvf_map.N3()+1; z++)
-		for (long y=0; y<d->m_bvf_map.N2()+1; y++)
-		for (long x=0; x<d->m_bvf_map.N1()+1; x++) {
-			if (is_on_an_interface(x,y,z,d->m_block_infos)) {
-				if (is_vertex(d->m_bvf_map,x,y,z)) {
+		for (long z=0; z<m_bvf_map.N3()+1; z++)
+		for (long y=0; y<m_bvf_map.N2()+1; y++)
+		for (long x=0; x<m_bvf_map.N1()+1; x++) {
+			if (is_on_an_interface(x,y,z,m_block_infos)) {
+				if (is_vertex(m_bvf_map,x,y,z)) {
 					for (int dd=0; dd<3; dd++) {
-						d->m_p.setupIndex(pass,dd,x,y,z);
+						m_p.setupIndex(pass,dd,x,y,z);
 					}
 				}
 			}
 		} 
 	}*/
 
+	//choose the tile size so that p and Ap of two tiles (the current one and the prefetched one) fit into L2
+	int tile_size=m_tile_size;
+	if (tile_size<0) {
+		long l2_size=get_l2_cache_size();
+		tile_size=1;
+		while ((double)(tile_size+2)*(tile_size+2)*(tile_size+2)*3*sizeof(float)*2*2<=l2_size) tile_size++;
+		tile_size=qMax(tile_size,4);
+	}
+	if (tile_size>0) printf("Using element tiles of size %d.\n",tile_size);
+
 	long num_variables=0;
+	int num_assembled=0;
+	double assembled_bytes=0;
+	double block_bytes=0;
 
-	for (int iii=0; iii<d->m_block_infos.count(); iii++) {
+	//create the blocks here, and let the threads extract their inputs from the shared bvf map and set them up.
+	//A block is set up by the thread (and on the cpus) that will iterate it, so that its pages are placed on that
+	//NUMA node, and the worker threads of the block are started there too, so they inherit these cpus.
+	start_task_graph();
+	QList<FBSetupTask *> setup_tasks;
+	m_task_graph.clear();
+	for (int iii=0; iii<m_block_infos.count(); iii++) {
 		FBBlock *B=new FBBlock(iii);
-		FBBlockSetupParameters PP;
-		PP.use_preconditioner=d->m_use_precondioner;
-		BlockInfo Info0=d->m_block_infos[iii];
-		for (int i=0; i<3; i++) PP.resolution[i]=d->m_resolution[i];
-		PP.Nx=Info0.xmax-Info0.xmin+1;
-		PP.Ny=Info0.ymax-Info0.ymin+1;
-		PP.Nz=Info0.zmax-Info0.zmin+1;
-		PP.block_x_position=Info0.xmin;
-		PP.block_y_position=Info0.ymin;
-		PP.block_z_position=Info0.zmin; 
-		//BVF
-		PP.BVF.allocate(PP.Nx+1,PP.Ny+1,PP.Nz+1);
-		for (int zz=Info0.zmin-1; zz<Info0.zmax+1; zz++)
-		for (int yy=Info0.ymin-1; yy<Info0.ymax+1; yy++)
-		for (int xx=Info0.xmin-1; xx<Info0.xmax+1; xx++) {
-			int xx0=xx-(Info0.xmin-1); int yy0=yy-(Info0.ymin-1); int zz0=zz-(Info0.zmin-1);
-			unsigned char val=d->m_bvf_map.value(xx,yy,zz);
-			PP.BVF.setValue(val,xx0,yy0,zz0);
-		}
-		//fixed variables
-		PP.fixed.allocate(PP.Nx+2,PP.Ny+2,PP.Nz+2,3);
-		for (int zz=Info0.zmin-1; zz<=Info0.zmax+1; zz++)
-		for (int yy=Info0.ymin-1; yy<=Info0.ymax+1; yy++)	
-		for (int xx=Info0.xmin-1; xx<=Info0.xmax+1; xx++)
-		for (int dd=0; dd<3; dd++) {
-			int xx0=xx-(Info0.xmin-1); int yy0=yy-(Info0.ymin-1); int zz0=zz-(Info0.zmin-1);
-			if (d->m_fixed_variables.value(dd,xx,yy,zz)) {
-				PP.fixed.setValue(1,xx0,yy0,zz0,dd);
-			}
-		}
-		//stiffness_matrix
-		PP.stiffness_matrix=d->m_stiffness_matrix;
-		PP.youngs_modulus=d->m_youngs_modulus;
-		PP.voxel_volume=d->m_voxel_volume;
-
-		//Initial displacements		
-		PP.X0.allocate(PP.Nx+2,PP.Ny+2,PP.Nz+2,3);
-		for (int zz=Info0.zmin-1; zz<=Info0.zmax+1; zz++)
-		for (int yy=Info0.ymin-1; yy<=Info0.ymax+1; yy++)	
-		for (int xx=Info0.xmin-1; xx<=Info0.xmax+1; xx++)
-		for (int dd=0; dd<3; dd++) {
-			int xx0=xx-(Info0.xmin-1); int yy0=yy-(Info0.ymin-1); int zz0=zz-(Info0.zmin-1);
-			PP.X0.setValue(d->m_initial_displacements.value(dd,xx,yy,zz),xx0,yy0,zz0,dd);   
-		}
-		//setup
-		B->setup(PP);
-		/*//set m_p on inner interfaces
-		PP.p_on_inner_interface.resetIteration();
-		while (PP.p_on_inner_interface.advanceIteration()) {
-			int dd0=PP.p_on_inner_interface.currentIndex1();
-			int xx0=PP.p_on_inner_interface.currentIndex2();
-			int yy0=PP.p_on_inner_interface.currentIndex3();
-			int zz0=PP.p_on_inner_interface.currentIndex4();			
-			float val0=PP.p_on_inner_interface.currentValue();
-			d->m_p.setValue(val0,dd0,Info0.xmin-1+xx0,Info0.ymin-1+yy0,Info0.zmin-1+zz0);
-		}*/
-		//store block in list		
-		d->m_block_infos[iii].p_on_top_inner_interface=PP.p_on_top_inner_interface;
-		d->m_block_infos[iii].p_on_bottom_inner_interface=PP.p_on_bottom_inner_interface;
-		d->m_blocks << B;
+		//each block gets a share of the operator memory budget in proportion to its vertices
+		BlockInfo *Info0=&m_block_infos[iii];
+		long block_vertex_count=0;
+		for (int zz=qMax(Info0->zmin,0); zz<=qMin(Info0->zmax,(int)m_bvf_map.N3()); zz++) block_vertex_count+=m_slice_vertex_count[zz];
+		FBSetupTask *T0=new FBSetupTask;
+		T0->solver=this;
+		T0->block=B;
+		T0->info=Info0;
+		T0->block_vertex_count=block_vertex_count;
+		T0->tile_size=tile_size;
+		T0->total_vertex_count=m_total_vertex_count;
+		setup_tasks << T0;
+		m_task_graph.addTask(T0,iii%m_num_threads);
+		m_blocks << B;
+	}
+	//a sparse array finishes its index on the first read, so do that here rather than in several threads at once
+	m_fixed_variables.value1(0);
+	m_initial_displacements.value1(0);
+	m_free_displacements.value1(0);
+	m_task_graph.run();
+	m_task_graph.clear();
+	qDeleteAll(setup_tasks);
+	m_block_times.fill(0,m_blocks.count());
 
+	for (int iii=0; iii<m_blocks.count(); iii++) {
+		FBBlock *B=m_blocks[iii];
 		num_variables+=B->ownedFreeVariableCount();
+		block_bytes+=B->memoryBytes();
+		if (B->operatorIsAssembled()) {
+			num_assembled++;
+			assembled_bytes+=B->assembledOperatorBytes();
+		}
 	}
 	printf("Total number of variables: %ld\n",num_variables);
-	printf("Using %d blocks.\n",d->m_blocks.count());
+	printf("Using %d blocks.\n",m_blocks.count());
+	if (num_assembled) printf("Assembled operator on %d blocks (%g MB).\n",num_assembled,assembled_bytes/(1024*1024));
+	if (m_low_memory) {
+		//the blocks have their own copies now, and nothing reads the global ones after the setup
+		FBSparseArray4D empty1,empty2,empty3;
+		m_initial_displacements.swap(empty1);
+		m_fixed_variables.swap(empty2);
+		m_free_displacements.swap(empty3);
+	}
+	if (num_variables) printf("Block storage: %g MB (%.1f bytes per variable).\n",block_bytes/(1024*1024),block_bytes/num_variables);
 	
 	printf("Setting up the Step A Parameters...\n");
-	d->m_PPP_A.clear();
-	for (long i=0; i<d->m_blocks.count(); i++) {
-		//FBBlock *B0=d->m_blocks[i];
+	m_PPP_A.clear();
+	for (long i=0; i<m_blocks.count(); i++) {
+		//FBBlock *B0=m_blocks[i];
 		FBBlockIterateStepAParameters PP;
 		//PP.p_on_outer_interface.allocate(DATA_TYPE_FLOAT,3,B0->Nx()+2,B0->Ny()+2,B0->Nz()+2);
 		/*for (int pass=1; pass<=2; pass++) {
@@ -334,20 +804,15 @@ void FBBlockSolver::solve() {
 				}
 			}
 		}*/
-		d->m_PPP_A << PP;
+		m_PPP_A << PP;
 	}
 	
 	printf("Setting up the Step B Parameters...\n");
-	d->m_PPP_B.clear();
-	for (int i=0; i<d->m_blocks.count(); i++) {
+	m_PPP_B.clear();
+	for (int i=0; i<m_blocks.count(); i++) {
 		FBBlockIterateStepBParameters PP;
-		d->m_PPP_B << PP;
+		m_PPP_B << PP;
 	}
-	FBTimer::stopTimer("setup");
-
-	d->do_iterations();
-	
-	FBTimer::stopTimer("solve");
 }
 
 class MyNonlinearAdjuster : public NonlinearAdjuster {
@@ -364,6 +829,10 @@ public:
 };
 
 void FBBlockSolver::solveNonlinear(float step_size,int num_steps,int num_iterations_per_step) {
+	if (d->m_low_memory) {
+		printf("Low-memory mode is not available for nonlinear analysis.\n");
+		d->m_low_memory=false;
+	}
 	solve(); //first do the linear simulation
 	
 	
@@ -389,79 +858,29 @@ long FBBlockSolver::setFixedVariables(FBMacroscopicStrain &macroscopic_strain) {
 	long N2=d->m_bvf_map.N2();
 	long N3=d->m_bvf_map.N3();
 
-	d->m_fixed_variables.allocate(DATA_TYPE_BYTE,3,N1+1,N2+1,N3+1);
-
-	for (int pass=1; pass<=3; pass++)
-	for (long i3=0; i3<N3+1; i3++)
-	for (long i2=0; i2<N2+1; i2++)
-	for (long i1=0; i1<N1+1; i1++) {
-		if (is_vertex(d->m_bvf_map,i1,i2,i3)) {
-			bool fix1=false,fix2=false,fix3=false;
-			if ((i1==0) ||(i1==N1)) {
-				if (macroscopic_strain.boundaryRestrictions[0][0])
-					fix1=true;
-				if (macroscopic_strain.boundaryRestrictions[0][1])
-					fix2=true;
-				if (macroscopic_strain.boundaryRestrictions[0][2])
-					fix3=true;
-			}
-			if ((i2==0) ||(i2==N2)) {
-				if (macroscopic_strain.boundaryRestrictions[1][0])
-					fix1=true;
-				if (macroscopic_strain.boundaryRestrictions[1][1])
-					fix2=true;
-				if (macroscopic_strain.boundaryRestrictions[1][2])
-					fix3=true;
-			}
-			if ((i3==0) ||(i3==N3)) {
-				if (macroscopic_strain.boundaryRestrictions[2][0])
-					fix1=true;
-				if (macroscopic_strain.boundaryRestrictions[2][1])
-					fix2=true;
-				if (macroscopic_strain.boundaryRestrictions[2][2])
-					fix3=true;
-			}
-			if (pass<=2) {
-				if (fix1) {d->m_fixed_variables.setupIndex(pass,0,i1,i2,i3);}
-				if (fix2) {d->m_fixed_variables.setupIndex(pass,1,i1,i2,i3);}
-				if (fix3) {d->m_fixed_variables.setupIndex(pass,2,i1,i2,i3);}
-			}
-			else if (pass==3) {
-				if (fix1) {d->m_fixed_variables.setValue(1,0,i1,i2,i3);}
-				if (fix2) {d->m_fixed_variables.setValue(1,1,i1,i2,i3);}
-				if (fix3) {d->m_fixed_variables.setValue(1,2,i1,i2,i3);}
-			}
-		}	
-	}
+	//evaluated in is_fixed as the blocks are set up
+	d->m_fixed_strain=macroscopic_strain;
+	d->m_fixed_from_strain=true;
+	FBSparseArray4D empty;
+	d->m_fixed_variables.swap(empty);
 	
 	printf("Counting elements...\n");
 	long num_elements=0;
-	for (long i3=0; i3<N3+1; i3++)
-	for (long i2=0; i2<N2+1; i2++)
-	for (long i1=0; i1<N1+1; i1++) {
-		if (is_element(d->m_bvf_map,i1,i2,i3))
+	for (long i3=0; i3<N3; i3++)
+	for (long i2=0; i2<N2; i2++)
+	for (long i1=0; i1<N1; i1++) {
+		if (d->m_bvf_map.value(i1,i2,i3))
 			num_elements++;
 	}
 	return(num_elements);
 }
 void FBBlockSolver::setInitialDisplacements(FBMacroscopicStrain &strain) {
-	long N1=d->m_bvf_map.N1();
-	long N2=d->m_bvf_map.N2();
-	long N3=d->m_bvf_map.N3();
-	d->m_initial_displacements.allocate(DATA_TYPE_FLOAT,3,N1+1,N2+1,N3+1);	
-	for (int pass=1; pass<=3; pass++)
-	for (long i3=0; i3<N3+1; i3++)
-	for (long i2=0; i2<N2+1; i2++)
-	for (long i1=0; i1<N1+1; i1++) {
-		if (is_vertex(d->m_bvf_map,i1,i2,i3)) {
-			for (int dd=0; dd<3; dd++) {
-				if (pass<=2) d->m_initial_displacements.setupIndex(pass,dd,i1,i2,i3);
-				else if (pass==3) {
-					d->m_initial_displacements.setValue(initial_displacement(i1,i2,i3,dd,d->m_resolution,strain),dd,i1,i2,i3);
-				}
-			}
-		}	
-	}
+	//evaluated in initial_value as the blocks are set up
+	d->m_displacement_strain=strain;
+	for (int i=0; i<3; i++) d->m_displacement_resolution[i]=d->m_resolution[i];
+	d->m_displacements_from_strain=true;
+	FBSparseArray4D empty;
+	d->m_initial_displacements.swap(empty);
 }
 void FBBlockSolver::getDisplacements(FBSparseArray4D &displacements) {
 	//here we must retrieve the displacements from the blocks.
@@ -471,7 +890,7 @@ void FBBlockSolver::getDisplacements(FBSparseArray4D &displacements) {
 		for (long z=0; z<d->m_bvf_map.N3()+1; z++)
 		for (long y=0; y<d->m_bvf_map.N2()+1; y++)
 		for (long x=0; x<d->m_bvf_map.N1()+1; x++)
-		if (is_vertex(d->m_bvf_map,x,y,z)) {
+		if (d->m_vertex_map.isOccupied(x,y,z)) {
 			for (int dd=0; dd<3; dd++) {
 				displacements.setupIndex(pass,dd,x,y,z);
 			}
@@ -485,7 +904,7 @@ void FBBlockSolver::getDisplacements(FBSparseArray4D &displacements) {
 		for (int kk=0; kk<d->m_blocks[i]->Nz(); kk++)
 		for (int jj=0; jj<d->m_blocks[i]->Ny(); jj++)
 		for (int ii=0; ii<d->m_blocks[i]->Nx(); ii++) {
-			if (is_vertex(d->m_bvf_map,x0+ii,y0+jj,z0+kk)) {
+			if (d->m_vertex_map.isOccupied(x0+ii,y0+jj,z0+kk)) {
 				for (int dd=0; dd<3; dd++) { 
 					fbreal displacement0=d->m_blocks[i]->getDisplacement(ii+1,jj+1,kk+1,dd);
 					displacements.setValue(displacement0,dd,x0+ii,y0+jj,z0+kk);
@@ -506,7 +925,7 @@ void FBBlockSolver::getDisplacements(FBArray4D<float> &displacements) {
 		for (int kk=0; kk<d->m_blocks[i]->Nz(); kk++)
 		for (int jj=0; jj<d->m_blocks[i]->Ny(); jj++)
 		for (int ii=0; ii<d->m_blocks[i]->Nx(); ii++) {
-			if (is_vertex(d->m_bvf_map,x0+ii,y0+jj,z0+kk)) {
+			if (d->m_vertex_map.isOccupied(x0+ii,y0+jj,z0+kk)) {
 				for (int dd=0; dd<3; dd++) { 
 					fbreal displacement0=d->m_blocks[i]->getDisplacement(ii+1,jj+1,kk+1,dd);
 					displacements.setValue(displacement0,dd,x0+ii,y0+jj,z0+kk);
@@ -523,7 +942,7 @@ void FBBlockSolver::getForces(FBSparseArray4D &forces) {
 		for (long z=0; z<d->m_bvf_map.N3()+1; z++)
 		for (long y=0; y<d->m_bvf_map.N2()+1; y++)
 		for (long x=0; x<d->m_bvf_map.N1()+1; x++)
-		if (is_vertex(d->m_bvf_map,x,y,z)) {
+		if (d->m_vertex_map.isOccupied(x,y,z)) {
 			for (int dd=0; dd<3; dd++) {
 				forces.setupIndex(pass,dd,x,y,z);
 			}
@@ -537,7 +956,7 @@ void FBBlockSolver::getForces(FBSparseArray4D &forces) {
 		for (int kk=0; kk<d->m_blocks[i]->Nz(); kk++)
 		for (int jj=0; jj<d->m_blocks[i]->Ny(); jj++)
 		for (int ii=0; ii<d->m_blocks[i]->Nx(); ii++) {
-			if (is_vertex(d->m_bvf_map,x0+ii,y0+jj,z0+kk)) {
+			if (d->m_vertex_map.isOccupied(x0+ii,y0+jj,z0+kk)) {
 				for (int dd=0; dd<3; dd++) { 
 					fbreal force0=d->m_blocks[i]->getForce(ii+1,jj+1,kk+1,dd);
 					forces.setValue(force0,dd,x0+ii,y0+jj,z0+kk);
@@ -589,18 +1008,36 @@ public:
 	return ret;
 }*/
 QList<double> FBBlockSolver::getStress() {
+	return d->total_stress();
+}
+QList<double> FBBlockSolverPrivate::total_stress() {
 	//this is the volume of the entire bvf map
-	double stress_denominator=(d->m_bvf_map.N1()*d->m_bvf_map.N2()*d->m_bvf_map.N3()*d->m_resolution[0]*d->m_resolution[1]*d->m_resolution[2]);
+	double stress_denominator=(m_bvf_map.N1()*m_bvf_map.N2()*m_bvf_map.N3()*m_resolution[0]*m_resolution[1]*m_resolution[2]);
 
 	QList<double> ret;	
 	for (int jj=0; jj<6; jj++) ret << 0;
-	for (int ii=0; ii<d->m_blocks.count(); ii++) {
-		double val0=0;
-		for (int jj=0; jj<6; jj++) ret[jj]+=d->m_PPP_B[ii].stress[jj];
+	for (int ii=0; ii<m_blocks.count(); ii++) {
+		for (int jj=0; jj<6; jj++) ret[jj]+=m_PPP_B[ii].stress[jj];
 	}
 	for (int jj=0; jj<6; jj++) ret[jj]/=stress_denominator;
 	return ret;
 }
+void FBBlockSolverPrivate::check_convergence() {
+	//runs in the task graph, once step B of all the blocks is done
+	FBTimer::startTimer("get_stress");
+	QList<double> stress0=total_stress();
+	FBTimer::stopTimer("get_stress");
+	m_error_estimator.addStressData(stress0);
+	/*qDebug()  << QString("Iteration %1, Stress: (%2,%3,%4,%5,%6,%7), Est. Rel. Err.: %8").arg(m_num_iterations)
+					.arg(stress0[0],0,'g',4).arg(stress0[1],0,'g',4).arg(stress0[2],0,'g',4)
+					.arg(stress0[3],0,'g',4).arg(stress0[4],0,'g',4).arg(stress0[5],0,'g',4)
+					.arg(m_error_estimator.estimatedRelativeError(),0,'g',4);
+	*/				
+	if (m_error_estimator.estimatedRelativeError()<m_epsilon) 
+		m_num_times_below_epsilon++;
+	else
+		m_num_times_below_epsilon=0;
+}
 int FBBlockSolver::getNumIterations() {
 	return d->m_num_iterations;
 }
@@ -640,154 +1077,56 @@ void FBBlockSolverPrivate::do_iterations() {
 	for (int ii=0; ii<m_blocks.count(); ii++) {
 		m_blocks[ii]->setNonlinearAdjuster(m_nonlinear_adjuster);
 	}
+	start_task_graph();
+	create_iteration_tasks();
 
 	FBTimer::startTimer("iterations");	
-	int num_times_below_epsilon=0;
-	while (((m_num_iterations<m_max_iterations)||(m_max_iterations<=0))&&(num_times_below_epsilon<5)) {
-		FBTimer::startTimer("setup_for_A");
-		//Set parameters for step A, i.e., p_on_outer_interface
-		/*{
-			for (long iblock=0; iblock<m_blocks.count(); iblock++) {
-				FBBlock *B0=m_blocks[iblock];
-				for (long zz=B0->zPosition()-1; zz<=B0->zPosition()+B0->Nz(); zz+=B0->Nz()+1) {
-					for (long yy=B0->yPosition()-1; yy<=B0->yPosition()+B0->Ny(); yy++)
-					for (long xx=B0->xPosition()-1; xx<=B0->xPosition()+B0->Nx(); xx++) 
-					for (int dd=0; dd<3; dd++) {
-						float val0=m_p.value(dd,xx,yy,zz);
-						if (val0) {
-							m_PPP_A[iblock].p_on_outer_interface.setValue(val0,dd,xx-(B0->xPosition()-1),yy-(B0->yPosition()-1),zz-(B0->zPosition()-1));
-						}
-					}
-				}
-			}
-		}*/	
-		for (int iblock=0; iblock<m_blocks.count(); iblock++) {
-			if (iblock-1>=0) m_PPP_A[iblock].p_on_top_outer_interface=m_block_infos[iblock-1].p_on_bottom_inner_interface;
-			if (iblock+1<m_blocks.count()) m_PPP_A[iblock].p_on_bottom_outer_interface=m_block_infos[iblock+1].p_on_top_inner_interface;
-		}
-		//iterate_step_A
-		double r_Ap=0;
-		double p_Ap=0;
-		double Ap_Ap=0;
-		double r_z=0;
-		QList<FBBlockSolverThread *> threads;
-		//define the threads
-		for (int i=0; i<m_num_threads; i++) {
-			FBBlockSolverThread *T0=new FBBlockSolverThread;
-			threads << T0;
-		}
-		//add the parameters and blocks to the threads
-		for (int i=0; i<m_blocks.count(); i++) {
-			int thread_number=0;
-			if (m_num_threads>1) thread_number=i%m_num_threads;
-			threads[thread_number]->step_A_parameters << &m_PPP_A[i];
-			threads[thread_number]->step_B_parameters << &m_PPP_B[i];
-			threads[thread_number]->blocks << m_blocks[i];
-		}
-		FBTimer::stopTimer("setup_for_A");
-		FBTimer::startTimer("step_A");
-		//start the threads
-		for (int i=0; i<m_num_threads; i++) {
-			threads[i]->do_step_A=true;
-			threads[i]->do_step_B=false;
-			threads[i]->start();
-		}
-		//wait until the threads are finished
-		{
-			bool done=false;
-			while (!done) {
-				QTest::qWait(10);
-				done=true;
-				for (int i=0; i<m_num_threads; i++) {
-					if (!threads[i]->isFinished()) {
-						done=false;
-					}
+	m_num_times_below_epsilon=0;
+	bool need_step_A=true;
+	while (((m_num_iterations<m_max_iterations)||(m_max_iterations<=0))&&(m_num_times_below_epsilon<5)) {
+		//(step A,) the reduction, step B, the convergence check and, speculatively, step A of the next iteration,
+		//see build_iteration_graph. Not in nonlinear analysis, where step A recomputes the residual from x.
+		bool last_iteration=((m_max_iterations>0)&&(m_num_iterations+1>=m_max_iterations));
+		bool speculate=((!m_nonlinear_adjuster)&&(!last_iteration));
+		build_iteration_graph(need_step_A,speculate);
+		FBTimer::startTimer("steps_A_B");
+		m_task_graph.run();
+		FBTimer::stopTimer("steps_A_B");
+		need_step_A=!speculate;
+		
+		m_num_iterations++;
+		
+		//repartition once, using the measured times of the blocks (not while the loop is about to end, since the new blocks have no stress yet)
+		if ((m_rebalance_iterations>0)&&(m_num_iterations==m_rebalance_iterations)&&(!m_nonlinear_adjuster)) {
+			if (((m_num_iterations<m_max_iterations)||(m_max_iterations<=0))&&(m_num_times_below_epsilon<5)) {
+				FBTimer::startTimer("rebalance");
+				if (rebalance()) {
+					//the speculative step A was done on the old blocks
+					create_iteration_tasks();
+					need_step_A=true;
 				}
+				FBTimer::stopTimer("rebalance");
 			}
 		}
-		FBTimer::stopTimer("step_A");
-		FBTimer::startTimer("setup_for_B");
-		//define the numbers
-		for (long i=0; i<m_blocks.count(); i++) {
-			r_z+=m_PPP_A[i].r_z;
-			r_Ap+=m_PPP_A[i].r_Ap;
-			p_Ap+=m_PPP_A[i].p_Ap;
-			Ap_Ap+=m_PPP_A[i].Ap_Ap;
-		}		
-		//iterate_step_B
-		for (long i=0; i<m_blocks.count(); i++) {
-			m_PPP_B[i].alpha=r_z/p_Ap; 
-			if (r_z!=0) m_PPP_B[i].beta=(r_z-2*m_PPP_B[i].alpha*r_Ap+m_PPP_B[i].alpha*m_PPP_B[i].alpha*Ap_Ap)/r_z;
-			else m_PPP_B[i].beta=0;
-			m_PPP_B[i].WN[0]=m_bvf_map.N1();
-			m_PPP_B[i].WN[1]=m_bvf_map.N2();
-			m_PPP_B[i].WN[2]=m_bvf_map.N3();
-		}	
-		FBTimer::stopTimer("setup_for_B");
-		FBTimer::startTimer("step_B");
-		//start the threads
-		for (int i=0; i<m_num_threads; i++) {
-			threads[i]->do_step_A=false;
-			threads[i]->do_step_B=true;
-			threads[i]->start();
-		}
-		//wait until the threads are finished
-		{
-			bool done=false;
-			while (!done) {
-				QTest::qWait(10);
-				done=true;
-				for (int i=0; i<m_num_threads; i++) {
-					if (!threads[i]->isFinished()) {
-						done=false;
-					}
-				}
-			}	
-		}
-		FBTimer::stopTimer("step_B");
-		FBTimer::startTimer("after_B");
-		qDeleteAll(threads);
-		threads.clear();
 		
-		/*FBTimer::startTimer("update_p_on_inner_interfaces");
-		//update m_p on inner interfaces
-		for (long i=0; i<m_blocks.count(); i++) {		
-			int x0=m_blocks[i]->xPosition();
-			int y0=m_blocks[i]->yPosition();
-			int z0=m_blocks[i]->zPosition();
-			m_PPP_B[i].p_on_inner_interface.resetIteration();
-			while (m_PPP_B[i].p_on_inner_interface.advanceIteration()) {
-				int dd0=m_PPP_B[i].p_on_inner_interface.currentIndex1();
-				int xx0=m_PPP_B[i].p_on_inner_interface.currentIndex2();
-				int yy0=m_PPP_B[i].p_on_inner_interface.currentIndex3();
-				int zz0=m_PPP_B[i].p_on_inner_interface.currentIndex4();
-				float val0=m_PPP_B[i].p_on_inner_interface.currentValue();
-				m_p.setValue(val0,dd0,x0-1+xx0,y0-1+yy0,z0-1+zz0);
-			}				
-		}
-		FBTimer::stopTimer("update_p_on_inner_interfaces");*/
+	}
+	
+	if (m_eliminate_fixed_variables) {
+		//the reaction forces were not updated in the iterations; one multiplication per block, on its own thread
+		FBTimer::startTimer("reconstruct_reactions");
+		QList<FBReactionTask *> reaction_tasks;
+		m_task_graph.clear();
+		m_iteration_graph_type=-1;
 		for (int i=0; i<m_blocks.count(); i++) {
-			m_block_infos[i].p_on_top_inner_interface=m_PPP_B[i].p_on_top_inner_interface;
-			m_block_infos[i].p_on_bottom_inner_interface=m_PPP_B[i].p_on_bottom_inner_interface;
+			FBReactionTask *T0=new FBReactionTask;
+			T0->block=m_blocks[i];
+			reaction_tasks << T0;
+			m_task_graph.addTask(T0,i%m_num_threads);
 		}
-		
-		m_num_iterations++;
-		
-		FBTimer::startTimer("get_stress");
-		QList<double> stress0=q->getStress();
-		FBTimer::stopTimer("get_stress");
-		m_error_estimator.addStressData(stress0);
-		/*qDebug()  << QString("Iteration %1, Stress: (%2,%3,%4,%5,%6,%7), Est. Rel. Err.: %8").arg(m_num_iterations)
-						.arg(stress0[0],0,'g',4).arg(stress0[1],0,'g',4).arg(stress0[2],0,'g',4)
-						.arg(stress0[3],0,'g',4).arg(stress0[4],0,'g',4).arg(stress0[5],0,'g',4)
-						.arg(m_error_estimator.estimatedRelativeError(),0,'g',4);
-		*/				
-		if (m_error_estimator.estimatedRelativeError()<m_epsilon) 
-			num_times_below_epsilon++;
-		else
-			num_times_below_epsilon=0;
-		FBTimer::stopTimer("after_B");
-		
+		m_task_graph.run();
+		m_task_graph.clear();
+		qDeleteAll(reaction_tasks);
+		FBTimer::stopTimer("reconstruct_reactions");
 	}
 	FBTimer::stopTimer("iterations");
 }
@@ -15,7 +15,20 @@ public:
 	void setEpsilon(fbreal epsilon);
 	void setMaxIterations(int val);
 	void setNumThreads(int val);
+	void setThreadCpus(const QList<int> &cpus); //pin the threads to these cpus (solver thread i to the i-th, or to the i-th group of threads-per-block cpus); empty for no pinning
 	void setUsePreconditioner(bool val);
+	void setOperatorMode(int mode); //OPERATOR_MODE_MATRIX_FREE, OPERATOR_MODE_ASSEMBLED or OPERATOR_MODE_AUTO
+	void setOperatorMemoryBudget(double megabytes); //total memory for assembled operators, shared by the blocks (auto mode)
+	void setVariableOrdering(int ordering); //VARIABLE_ORDERING_LEXICOGRAPHIC or VARIABLE_ORDERING_MORTON
+	void setVectorLayout(int layout); //VECTOR_LAYOUT_SPLIT or VECTOR_LAYOUT_INTERLEAVED
+	void setTileSize(int val); //edge length of the element tiles, 0 = no tiling, -1 = chosen from the L2 cache size
+	void setThreadsPerBlock(int val); //threads working inside each block, in addition to the parallelism over the blocks
+	void setScratchDirectory(const QString &path); //keep the block arrays in memory-mapped files there, for volumes that do not fit into memory
+	void setNumBlocks(int val); //number of z-slabs, if more than the number of threads; the threads work through their blocks in z order
+	void setLowMemory(bool val); //drop the storage that can be recomputed (Ap, the preconditioner and the element lists), at the cost of a second multiplication per iteration
+	void setStressFromReactions(bool val); //sum the stress over the reaction forces of the fixed variables only, which carry all of it at convergence
+	void setEliminateFixedVariables(bool val); //do not update the reaction forces during the iterations, but once at the end (not in low-memory mode)
+	void setRebalancing(int num_iterations,double threshold); //after num_iterations, repartition from the measured block times if the slowest thread takes more than threshold times the mean (0 = never)
 	void setStiffnessMatrix(const FBArray2D<float> &stiffness_matrix);
 	void setYoungsModulus(float val);
 	void setVoxelVolume(float val);
@@ -0,0 +1,157 @@
+#include "fbcputopology.h"
+#include "textfile.h"
+#include <QThread>
+#include <QStringList>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+QList<int> parse_cpu_list(const QString &txt) {
+	QList<int> ret;
+	QStringList ranges=txt.trimmed().split(",");
+	for (int i=0; i<ranges.count(); i++) {
+		QString range=ranges[i].trimmed();
+		if (range.isEmpty()) continue;
+		QStringList ends=range.split("-");
+		bool ok1=false,ok2=true;
+		int first=ends[0].toInt(&ok1);
+		int last=first;
+		if (ends.count()>1) last=ends[1].toInt(&ok2);
+		if ((!ok1)||(!ok2)) continue;
+		for (int cpu=first; cpu<=last; cpu++) ret << cpu;
+	}
+	return ret;
+}
+
+int read_sys_integer(const QString &path,int default_value) {
+	bool ok=false;
+	int ret=read_text_file(path).trimmed().toInt(&ok);
+	if (!ok) return default_value;
+	return ret;
+}
+
+FBCpuTopology::FBCpuTopology() {
+	m_from_system=false;
+	QList<int> allowed=fb_process_cpus();
+	QList<int> online=parse_cpu_list(read_text_file("/sys/devices/system/cpu/online"));
+	if (!allowed.isEmpty()) {
+		QList<int> online_allowed;
+		for (int i=0; i<online.count(); i++) {
+			if (allowed.contains(online[i])) online_allowed << online[i];
+		}
+		online=online_allowed;
+	}
+	if (!online.isEmpty()) {
+		m_from_system=true;
+		for (int i=0; i<online.count(); i++) {
+			QString dir=QString("/sys/devices/system/cpu/cpu%1/topology/").arg(online[i]);
+			FBLogicalCpu C;
+			C.cpu=online[i];
+			C.package=read_sys_integer(dir+"physical_package_id",0);
+			C.core=read_sys_integer(dir+"core_id",online[i]);
+			C.node=0;
+			m_cpus << C;
+		}
+		QList<int> nodes=parse_cpu_list(read_text_file("/sys/devices/system/node/online"));
+		for (int n=0; n<nodes.count(); n++) {
+			QList<int> node_cpus=parse_cpu_list(read_text_file(QString("/sys/devices/system/node/node%1/cpulist").arg(nodes[n])));
+			for (int i=0; i<m_cpus.count(); i++) {
+				if (node_cpus.contains(m_cpus[i].cpu)) m_cpus[i].node=nodes[n];
+			}
+		}
+	}
+	else {
+		if (allowed.isEmpty()) {
+			int num=qMax(QThread::idealThreadCount(),1);
+			for (int i=0; i<num; i++) allowed << i;
+		}
+		for (int i=0; i<allowed.count(); i++) {
+			FBLogicalCpu C;
+			C.cpu=allowed[i]; C.package=0; C.core=allowed[i]; C.node=0;
+			m_cpus << C;
+		}
+	}
+}
+
+bool FBCpuTopology::isFromSystem() const {
+	return m_from_system;
+}
+
+int FBCpuTopology::logicalCpuCount() const {
+	return m_cpus.count();
+}
+
+int FBCpuTopology::sibling_number(int i) const {
+	int ret=0;
+	for (int j=0; j<i; j++) {
+		if ((m_cpus[j].package==m_cpus[i].package)&&(m_cpus[j].core==m_cpus[i].core)) ret++;
+	}
+	return ret;
+}
+
+int FBCpuTopology::physicalCoreCount() const {
+	int ret=0;
+	for (int i=0; i<m_cpus.count(); i++) {
+		if (sibling_number(i)==0) ret++;
+	}
+	return ret;
+}
+
+int FBCpuTopology::numaNodeCount() const {
+	QList<int> nodes;
+	for (int i=0; i<m_cpus.count(); i++) {
+		if (!nodes.contains(m_cpus[i].node)) nodes << m_cpus[i].node;
+	}
+	return nodes.count();
+}
+
+QList<int> FBCpuTopology::workerCpus(bool use_smt) const {
+	QList<int> siblings;
+	int max_sibling=0;
+	for (int i=0; i<m_cpus.count(); i++) {
+		siblings << sibling_number(i);
+		max_sibling=qMax(max_sibling,siblings[i]);
+	}
+	QList<int> nodes;
+	for (int i=0; i<m_cpus.count(); i++) {
+		if (!nodes.contains(m_cpus[i].node)) nodes << m_cpus[i].node;
+	}
+	qSort(nodes);
+	QList<int> ret;
+	int num_rounds=1;
+	if (use_smt) num_rounds=max_sibling+1;
+	for (int round=0; round<num_rounds; round++)
+	for (int n=0; n<nodes.count(); n++)
+	for (int i=0; i<m_cpus.count(); i++) {
+		if ((m_cpus[i].node==nodes[n])&&(siblings[i]==round)) ret << m_cpus[i].cpu;
+	}
+	return ret;
+}
+
+bool fb_pin_current_thread(const QList<int> &cpus) {
+#ifdef __linux__
+	if (cpus.isEmpty()) return false;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int i=0; i<cpus.count(); i++) {
+		if ((cpus[i]>=0)&&(cpus[i]<CPU_SETSIZE)) CPU_SET(cpus[i],&set);
+	}
+	return (sched_setaffinity(0,sizeof(set),&set)==0);
+#else
+	Q_UNUSED(cpus)
+	return false;
+#endif
+}
+
+QList<int> fb_process_cpus() {
+	QList<int> ret;
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0,sizeof(set),&set)!=0) return ret;
+	for (int cpu=0; cpu<CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu,&set)) ret << cpu;
+	}
+#endif
+	return ret;
+}
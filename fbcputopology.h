@@ -0,0 +1,37 @@
+#ifndef fbcputopology_H
+#define fbcputopology_H
+
+#include <QList>
+
+struct FBLogicalCpu {
+	int cpu; //the number used by the system (and by fb_pin_current_thread)
+	int package;
+	int core; //core_id within the package; SMT siblings share package and core
+	int node; //NUMA node
+};
+
+//The logical CPUs this process may run on (its affinity mask, which taskset, a cgroup cpuset or a batch scheduler
+//may have restricted) and how they are grouped into physical cores and NUMA nodes, read from /sys/devices/system
+//on Linux. Elsewhere (or if /sys is not readable) every one of these CPUs, or of QThread::idealThreadCount() CPUs,
+//is taken to be its own core on a single node, and isFromSystem() returns false.
+class FBCpuTopology {
+public:
+	FBCpuTopology();
+	bool isFromSystem() const;
+	int logicalCpuCount() const;
+	int physicalCoreCount() const;
+	int numaNodeCount() const;
+	//The CPUs to run the worker threads on: the first logical CPU of each physical core, node by node, so that
+	//threads working on neighbouring blocks share a node. With use_smt the other SMT siblings follow, in the same order.
+	QList<int> workerCpus(bool use_smt) const;
+private:
+	QList<FBLogicalCpu> m_cpus;
+	bool m_from_system;
+	int sibling_number(int i) const; //0 for the first logical CPU of its core, 1 for the next, ...
+};
+
+QList<int> parse_cpu_list(const QString &txt); //"0-3,8,10-11" as used in /sys
+bool fb_pin_current_thread(const QList<int> &cpus); //restricts the calling thread to these CPUs; false if not supported
+QList<int> fb_process_cpus(); //the CPUs in the affinity mask of the process; empty if not supported
+
+#endif
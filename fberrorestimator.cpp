@@ -9,12 +9,14 @@ public:
 	FBErrorEstimator *q;
 	QList<DoubleList> m_stress_records;
 	QList<double> m_estimated_relative_errors;
+	bool m_track_all_components;
 };
 
 FBErrorEstimator::FBErrorEstimator() 
 {
 	d=new FBErrorEstimatorPrivate;
 	d->q=this;
+	d->m_track_all_components=false;
 }
 
 FBErrorEstimator::~FBErrorEstimator()
@@ -24,6 +26,9 @@ FBErrorEstimator::~FBErrorEstimator()
 void FBErrorEstimator::addStressData(const QList<double> &stress) {
 	d->m_stress_records << stress;
 }
+void FBErrorEstimator::setTrackAllComponents(bool val) {
+	d->m_track_all_components=val;
+}
 void estimate_slope_intercept(double &slope,double &intercept,const QList<double> &data) {
 	int N=data.count();
 	double Sx=0;
@@ -48,24 +53,13 @@ void estimate_slope_intercept(double &slope,double &intercept,const QList<double
 	}
 }
 
-double compute_estimated_relative_error(const QList<DoubleList> &stress_records,int iteration) {	
-	int min_iterations_to_use=30;
-	int num_iterations_to_use=30;
-	if (iteration+1<min_iterations_to_use) return 1;
-	QList<double> last_stress=stress_records[iteration];
-	int max_index=0;
-	double max_val=0;
-	for (int ii=0; ii<last_stress.count(); ii++) {
-		if (qAbs(last_stress[ii])>max_val) {
-			max_val=qAbs(last_stress[ii]);
-			max_index=ii;
-		}
-	}
-	
+//Estimates the log of the remaining (absolute) change of component index of the stress, from the iterations up to
+//the given one. Returns false if the changes do not decay.
+bool estimate_log_error(double &est_log_error,const QList<DoubleList> &stress_records,int iteration,int index,int num_iterations_to_use) {
 	//We assume that Y[j] = a + b*exp(-c*j)
 	QList<double> Y; //vector of stresses
 	for (int ii=qMax(iteration+1-num_iterations_to_use,0); ii<iteration+1; ii++) {
-		Y << (stress_records[ii])[max_index];
+		Y << (stress_records[ii])[index];
 	}
 	//compute the derivative: Y_prime[j] = -b*c*exp(-c*j)
 	QList<double> Y_prime;
@@ -82,13 +76,51 @@ double compute_estimated_relative_error(const QList<DoubleList> &stress_records,
 	double slope,intercept;
 	estimate_slope_intercept(slope,intercept,log_Y_prime);
 	//We solve c = -slope, and log(abs(b)) = intercept-log(abs(c))
-	double c=-slope; if (c<=0) return 1;
+	double c=-slope; if (c<=0) return false;
 	double log_abs_b=intercept-log(qAbs(c));
 	//the estimated error is abs(b)*exp(-c*N)
 	//so the estimated log error is log|b| - c*N
-	double est_log_error=log_abs_b-c*(log_Y_prime.count()-1);
-	//the log  relative error is this minus log(|Y[N]|)
-	double log_rel_error=est_log_error-log(qAbs(Y[Y.count()-1]));
+	est_log_error=log_abs_b-c*(log_Y_prime.count()-1);
+	return true;
+}
+
+double compute_estimated_relative_error(const QList<DoubleList> &stress_records,int iteration,bool all_components) {	
+	int min_iterations_to_use=30;
+	int num_iterations_to_use=30;
+	if (iteration+1<min_iterations_to_use) return 1;
+	QList<double> last_stress=stress_records[iteration];
+	int max_index=0;
+	double max_val=0;
+	for (int ii=0; ii<last_stress.count(); ii++) {
+		if (qAbs(last_stress[ii])>max_val) {
+			max_val=qAbs(last_stress[ii]);
+			max_index=ii;
+		}
+	}
+	
+	double log_rel_error=0;
+	if (!all_components) {
+		double est_log_error;
+		if (!estimate_log_error(est_log_error,stress_records,iteration,max_index,num_iterations_to_use)) return 1;
+		//the log  relative error is this minus log(|Y[N]|)
+		log_rel_error=est_log_error-log(qAbs(last_stress[max_index]));
+	}
+	else {
+		//every component relative to the largest one, since the small (e.g. shear) components can be near zero;
+		//a component that has stopped changing (at this scale) is converged even though its changes do not decay,
+		//and one whose changes do not decay (e.g. single precision noise) is taken to be as far off as its recent changes
+		log_rel_error=-20;
+		for (int ii=0; ii<last_stress.count(); ii++) {
+			double max_change=0;
+			for (int jj=qMax(iteration+1-num_iterations_to_use,1); jj<iteration+1; jj++) {
+				max_change=qMax(max_change,qAbs(stress_records[jj][ii]-stress_records[jj-1][ii]));
+			}
+			if (max_change<=max_val*exp(-20.0)) continue;
+			double est_log_error;
+			if (!estimate_log_error(est_log_error,stress_records,iteration,ii,num_iterations_to_use)) est_log_error=log(max_change);
+			log_rel_error=qMax(log_rel_error,est_log_error-log(max_val));
+		}
+	}
 	if (log_rel_error<=-20) return exp(-20);
 	if (log_rel_error>=0) return 1;
 	return exp(log_rel_error); //we avoid computing exp until very end
@@ -98,7 +130,7 @@ double FBErrorEstimator::estimatedRelativeError(int iteration) const {
 	if (iteration<0) iteration=d->m_stress_records.count()-1;
 	if (iteration>=d->m_stress_records.count()) return 1;
 	while (iteration>=d->m_estimated_relative_errors.count()) {
-		float val0=compute_estimated_relative_error(d->m_stress_records,iteration);
+		float val0=compute_estimated_relative_error(d->m_stress_records,iteration,d->m_track_all_components);
 		d->m_estimated_relative_errors << val0;
 	}
 	if ((iteration>=0)&&(iteration<d->m_estimated_relative_errors.count()))
@@ -10,6 +10,7 @@ public:
 	FBErrorEstimator();
 	virtual ~FBErrorEstimator();
 	void addStressData(const QList<double> &stress);
+	void setTrackAllComponents(bool val); //estimate the error of every stress component (relative to the largest one), rather than of the largest one only
 	double estimatedRelativeError(int iteration=-1) const;
 	QList<double> stressData(int iteration);
 private:
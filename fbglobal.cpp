@@ -1,139 +1,42 @@
 #include "fbglobal.h"
-
-struct PolynomialTerm {
-	fbreal coefficient;
-	QList<int> exponents; // x, (1-x), y, (1-y), z, (1-z)
+#include <QMutex>
+
+//The shape function of the element vertex a=(a1,a2,a3) is L(a1,x)L(a2,y)L(a3,z), with L(0,t)=1-t and L(1,t)=t,
+//so every strain component of a unit displacement of a vertex is either zero or the derivative of its shape
+//function along a single axis. For a strain index (11,22,33,12,13,23) and the displacement direction,
+//this is the axis of that derivative, or -1 if the strain does not depend on the displacement.
+static const int strain_derivative_axis[6][3]={
+	{0,-1,-1}, //eps11
+	{-1,1,-1}, //eps22
+	{-1,-1,2}, //eps33
+	{1,0,-1}, //eps12
+	{2,-1,0}, //eps13
+	{-1,2,1} //eps23
 };
 
-class Polynomial {
-public:
-	Polynomial() {}
-	Polynomial(const Polynomial &P) {copy_from(P);}
-	virtual ~Polynomial() {}
-	int termCount() const {return m_terms.count();}
-	PolynomialTerm term(int ind) const {return m_terms[ind];}
-	void addTerm(PolynomialTerm T) {m_terms << T;}
-	void addTerm(fbreal coeff,int e1,int e2,int e3,int e4,int e5,int e6);
-	Polynomial operator*(const Polynomial &P);
-	void operator=(const Polynomial &P) {copy_from(P);}
-	fbreal integral(fbreal a,fbreal b,fbreal c);
-private:
-	QList<PolynomialTerm> m_terms;
-	
-	void copy_from(const Polynomial &P) {
-		m_terms.clear();
-		for (int j=0; j<P.termCount(); j++) {
-			addTerm(P.term(j));
-		}
-	}
-};
-
-
-Polynomial Polynomial::operator*(const Polynomial &P) {
-	Polynomial ret;
-	for (int i=0; i<termCount(); i++)
-		for (int j=0; j<P.termCount(); j++) {
-			PolynomialTerm T;
-			T.exponents.clear();
-			for (int k=0; k<6; k++) {
-				T.exponents << term(i).exponents[k]+P.term(i).exponents[k];
-			}
-			T.coefficient=term(i).coefficient*P.term(i).coefficient;
-			ret.addTerm(T);
-		}
-	return ret;
-}
-
-fbreal get_factor(int i1,int i2,fbreal res) {
-	if ((i1==0)&&(i2==0)) return 1.0F/res;
-	if ((i1==0)&&(i2==1)) return 1.0F/2;
-	if ((i1==1)&&(i2==0)) return 1.0F/2;
-	if ((i1==1)&&(i2==1)) return 1.0F/6*res;
-	if ((i1==2)&&(i2==0)) return 1.0F/3*res;
-	if ((i1==0)&&(i2==2)) return 1.0F/3*res;
-	return 0;
-}
-
-fbreal term_integral(PolynomialTerm T,fbreal a,fbreal b,fbreal c) {
-	return T.coefficient
-			*get_factor(T.exponents[0],T.exponents[1],a)
-			*get_factor(T.exponents[2],T.exponents[3],b)
-			*get_factor(T.exponents[4],T.exponents[5],c);
+//integral over one axis (of length res) of the product of the two one-dimensional factors of the shape
+//functions of vertices a and b, where either factor may be differentiated along that axis
+inline fbreal axis_integral(int a,int b,bool diff_a,bool diff_b,fbreal res) {
+	if ((diff_a)&&(diff_b)) return 1.0F/res;
+	if ((diff_a)||(diff_b)) return 1.0F/2;
+	if (a==b) return 1.0F/3*res;
+	return 1.0F/6*res;
 }
 
-fbreal Polynomial::integral(fbreal a,fbreal b,fbreal c) {
-	fbreal ret=0;
-	for (int j=0; j<termCount(); j++) {
-		ret+=term_integral(term(j),a,b,c);
-	}
-	return ret;
+//sign of the derivative of L(a,t)
+inline fbreal derivative_sign(int a) {
+	if (a==0) return -1;
+	return 1;
 }
 
-void Polynomial::addTerm(fbreal coeff,int e1,int e2,int e3,int e4,int e5,int e6) {
-	PolynomialTerm T;
-	T.coefficient=coeff;
-	T.exponents << e1 << e2 << e3 << e4 << e5 << e6;
-	addTerm(T);
-}
-
-Polynomial get_eps11_term(int a1,int a2,int a3,int dir) {
-	Polynomial ret;
-	if (dir!=0) return ret;
-	PolynomialTerm T;
-	if (a1==0) T.coefficient=-1; else T.coefficient=1;
-	for (int j=0; j<6; j++) T.exponents << 0;
-	if (a2==0) T.exponents[3]=1; else T.exponents[2]=1;
-	if (a3==0) T.exponents[5]=1; else T.exponents[4]=1;
-	ret.addTerm(T);
-	return ret;
-}
-
-Polynomial get_eps22_term(int a1,int a2,int a3,int dir) {
-	Polynomial ret;
-	if (dir!=1) return ret;
-	PolynomialTerm T;
-	if (a2==0) T.coefficient=-1; else T.coefficient=1;
-	for (int j=0; j<6; j++) T.exponents << 0;
-	if (a1==0) T.exponents[1]=1; else T.exponents[0]=1;
-	if (a3==0) T.exponents[5]=1; else T.exponents[4]=1;
-	ret.addTerm(T);
-	return ret;
-}
-
-Polynomial get_eps33_term(int a1,int a2,int a3,int dir) {
-	Polynomial ret;
-	if (dir!=2) return ret;
-	PolynomialTerm T;
-	if (a3==0) T.coefficient=-1; else T.coefficient=1;
-	for (int j=0; j<6; j++) T.exponents << 0;
-	if (a1==0) T.exponents[1]=1; else T.exponents[0]=1;
-	if (a2==0) T.exponents[3]=1; else T.exponents[2]=1;
-	ret.addTerm(T);
-	return ret;
-}
-
-Polynomial get_eps12_term(int a1,int a2,int a3,int dir) {
-	if (dir==0) return get_eps22_term(a1,a2,a3,1);
-	else if (dir==1) return get_eps11_term(a1,a2,a3,0);
-	Polynomial ret;
-	return ret;
-}
-
-Polynomial get_eps13_term(int a1,int a2,int a3,int dir) {
-	if (dir==0) return get_eps33_term(a1,a2,a3,2);
-	else if (dir==2) return get_eps11_term(a1,a2,a3,0);
-	Polynomial ret;
-	return ret;
-}
-
-Polynomial get_eps23_term(int a1,int a2,int a3,int dir) {
-	if (dir==1) return get_eps33_term(a1,a2,a3,2);
-	else if (dir==2) return get_eps22_term(a1,a2,a3,1);
-	Polynomial ret;
-	return ret;
-}
+struct FBStiffnessKernelCacheEntry {
+	fbreal youngs_modulus;
+	fbreal poissons_ratio;
+	fbreal resolution[3];
+	FBArray2D<float> stiffness_matrix;
+};
 
-void compute_stiffness_kernel(FBArray2D<float> &stiffness_matrix,const fbreal youngs_modulus,const fbreal poissons_ratio,const QList<fbreal> &resolution) {
+void compute_stiffness_kernel_closed_form(FBArray2D<float> &stiffness_matrix,const fbreal youngs_modulus,const fbreal poissons_ratio,const QList<fbreal> &resolution) {
 	fbreal factor=youngs_modulus/((1+poissons_ratio)*(1-2*poissons_ratio));
 	fbreal stiffness_tensor[6][6];
 	for (int i=0; i<6; i++)
@@ -147,44 +50,62 @@ void compute_stiffness_kernel(FBArray2D<float> &stiffness_matrix,const fbreal yo
 		for (int j=0; j<24; j++) {
 			stiffness_matrix.setValue(0,i,j);
 		}
-	for (int a1=0; a1<=1; a1++)
-	for (int a2=0; a2<=1; a2++)
 	for (int a3=0; a3<=1; a3++)
-	for (int adir=0; adir<3; adir++) {
-		int aind=adir+a1*3+a2*6+a3*12;
-		for (int b1=0; b1<=1; b1++)
-		for (int b2=0; b2<=1; b2++)
-		for (int b3=0; b3<=1; b3++)
-		for (int bdir=0; bdir<3; bdir++) {
-			int bind=bdir+b1*3+b2*6+b3*12;	
-			Polynomial deps_da[6]; //derivative of strain w.r.t. a
-			Polynomial deps_db[6]; //derivative of strain w.r.t. b
-			
-			deps_da[0]=get_eps11_term(a1,a2,a3,adir);
-			deps_db[0]=get_eps11_term(b1,b2,b3,bdir);
-			deps_da[1]=get_eps22_term(a1,a2,a3,adir);
-			deps_db[1]=get_eps22_term(b1,b2,b3,bdir);
-			deps_da[2]=get_eps33_term(a1,a2,a3,adir);
-			deps_db[2]=get_eps33_term(b1,b2,b3,bdir);
-			deps_da[3]=get_eps12_term(a1,a2,a3,adir);
-			deps_db[3]=get_eps12_term(b1,b2,b3,bdir);
-			deps_da[4]=get_eps13_term(a1,a2,a3,adir);
-			deps_db[4]=get_eps13_term(b1,b2,b3,bdir);
-			deps_da[5]=get_eps23_term(a1,a2,a3,adir);
-			deps_db[5]=get_eps23_term(b1,b2,b3,bdir);
-
-			fbreal coeff=0;			
-			for (int i=0; i<6; i++)
-			for (int j=0; j<6; j++) {
-				Polynomial P;
-				P=deps_da[i]*deps_db[j];
-				coeff += -P.integral(resolution[0],resolution[1],resolution[2])*stiffness_tensor[i][j];
+	for (int a2=0; a2<=1; a2++)
+	for (int a1=0; a1<=1; a1++)
+	for (int b3=0; b3<=1; b3++)
+	for (int b2=0; b2<=1; b2++)
+	for (int b1=0; b1<=1; b1++) {
+		int a[3]={a1,a2,a3};
+		int b[3]={b1,b2,b3};
+		//G[p][q] = integral over the element of dN_a/dx_p * dN_b/dx_q
+		fbreal G[3][3];
+		for (int p=0; p<3; p++)
+		for (int q=0; q<3; q++) {
+			fbreal val=derivative_sign(a[p])*derivative_sign(b[q]);
+			for (int m=0; m<3; m++) val*=axis_integral(a[m],b[m],p==m,q==m,resolution[m]);
+			G[p][q]=val;
+		}
+		for (int adir=0; adir<3; adir++) {
+			int aind=adir+a1*3+a2*6+a3*12;
+			for (int bdir=0; bdir<3; bdir++) {
+				int bind=bdir+b1*3+b2*6+b3*12;
+				fbreal coeff=0;
+				for (int i=0; i<6; i++) {
+					int p=strain_derivative_axis[i][adir];
+					if (p<0) continue;
+					for (int j=0; j<6; j++) {
+						int q=strain_derivative_axis[j][bdir];
+						if (q<0) continue;
+						coeff += -G[p][q]*stiffness_tensor[i][j];
+					}
+				}
+				stiffness_matrix.setValue(coeff,aind,bind);
 			}
-			
-			stiffness_matrix.setValue(stiffness_matrix.value(aind,bind)+coeff,aind,bind);
 		}
 	}
 }
+
+void compute_stiffness_kernel(FBArray2D<float> &stiffness_matrix,const fbreal youngs_modulus,const fbreal poissons_ratio,const QList<fbreal> &resolution) {
+	//the kernel only depends on these five numbers, so it is computed once for each combination (parameter sweeps)
+	static QMutex cache_mutex;
+	static QList<FBStiffnessKernelCacheEntry> cache;
+	QMutexLocker locker(&cache_mutex);
+	for (int i=0; i<cache.count(); i++) {
+		const FBStiffnessKernelCacheEntry &E=cache[i];
+		if ((E.youngs_modulus==youngs_modulus)&&(E.poissons_ratio==poissons_ratio)&&(E.resolution[0]==resolution[0])&&(E.resolution[1]==resolution[1])&&(E.resolution[2]==resolution[2])) {
+			stiffness_matrix=E.stiffness_matrix;
+			return;
+		}
+	}
+	compute_stiffness_kernel_closed_form(stiffness_matrix,youngs_modulus,poissons_ratio,resolution);
+	FBStiffnessKernelCacheEntry E;
+	E.youngs_modulus=youngs_modulus;
+	E.poissons_ratio=poissons_ratio;
+	for (int i=0; i<3; i++) E.resolution[i]=resolution[i];
+	E.stiffness_matrix=stiffness_matrix;
+	cache << E;
+}
 bool is_element(FBArray3D<unsigned char> &bvfmap,long i1,long i2,long i3) {
 	if ((i1<0)||(i1>=bvfmap.N1())) return false;
 	if ((i2<0)||(i2>=bvfmap.N2())) return false;
@@ -209,3 +130,15 @@ fbreal initial_displacement(int i1,int i2,int i3,int dir,fbreal resolution[3],FB
 	if (dir==2) return macroscopic_strain.eps13/2*x+macroscopic_strain.eps23/2*y+macroscopic_strain.eps33*z;
 	return 0;
 }
+
+long get_l2_cache_size() {
+	long ret=256*1024; //a conservative default
+	QString txt=read_text_file("/sys/devices/system/cpu/cpu0/cache/index2/size").trimmed();
+	if (txt.isEmpty()) return ret;
+	long factor=1;
+	if (txt.endsWith("K")) {factor=1024; txt=txt.mid(0,txt.count()-1);}
+	else if (txt.endsWith("M")) {factor=1024*1024; txt=txt.mid(0,txt.count()-1);}
+	long val=txt.toLong()*factor;
+	if (val>0) ret=val;
+	return ret;
+}
@@ -6,6 +6,13 @@
 
 typedef float fbreal;
 
+//hint the processor to load the cache line containing ADDR (no-op where the builtin is not available)
+#ifdef __GNUC__
+#define FB_PREFETCH(ADDR) __builtin_prefetch(ADDR)
+#else
+#define FB_PREFETCH(ADDR)
+#endif
+
 struct FBMacroscopicStrain {
 	//components of the macroscopic strain tensor
 	fbreal eps11,eps22,eps33;
@@ -20,6 +27,7 @@ void compute_stiffness_kernel(FBArray2D<float> &stiffness_matrix,const fbreal yo
 fbreal initial_displacement(int i1,int i2,int i3,int dir,fbreal resolution[3],FBMacroscopicStrain &macroscopic_strain);
 bool is_vertex(FBArray3D<unsigned char> &bvfmap,long i1,long i2,long i3);
 bool is_element(FBArray3D<unsigned char> &bvfmap,long i1,long i2,long i3);
+long get_l2_cache_size(); //in bytes, from /sys when available
 
 
 #endif
@@ -0,0 +1,91 @@
+#include "fboccupancybitmap.h"
+
+FBOccupancyBitmap::FBOccupancyBitmap()
+{
+	m_N1=m_N2=m_N3=0;
+	m_words_per_row=0;
+}
+
+void FBOccupancyBitmap::allocate(long N1,long N2,long N3) {
+	clear();
+	m_N1=N1; m_N2=N2; m_N3=N3;
+	m_words_per_row=(N1+63)/64;
+	long num_words=m_words_per_row*N2*N3;
+	if (!num_words) return;
+	m_bits.allocate(num_words);
+	m_word_indices.allocate(num_words);
+}
+
+void FBOccupancyBitmap::setOccupied(long i1,long i2,long i3) {
+	if ((i1<0)||(i1>=m_N1)||(i2<0)||(i2>=m_N2)||(i3<0)||(i3>=m_N3)) return;
+	m_bits.ptr[(i2+m_N2*i3)*m_words_per_row+i1/64]|=((fbbitword)1)<<(i1%64);
+}
+
+void FBOccupancyBitmap::setFromElements(const FBArray3D<unsigned char> &elements) {
+	//A point is occupied if one of the (up to) 8 elements around it is nonzero. Each row of elements
+	//becomes a row of bits, which is dilated by one in i1 with word shifts and then or-ed into the
+	//four rows of points that the elements touch, so the work is per word rather than per point.
+	long M1=elements.N1(),M2=elements.N2(),M3=elements.N3();
+	allocate(M1+1,M2+1,M3+1);
+	if (!m_bits.ptr) return;
+	QVector<fbbitword> row(m_words_per_row);
+	fbbitword *R=row.data();
+	for (long i3=0; i3<M3; i3++)
+	for (long i2=0; i2<M2; i2++) {
+		for (long ww=0; ww<m_words_per_row; ww++) R[ww]=0;
+		bool found=false;
+		for (long i1=0; i1<M1; i1++) {
+			if (elements.value(i1,i2,i3)) {
+				R[i1/64]|=((fbbitword)1)<<(i1%64);
+				found=true;
+			}
+		}
+		if (!found) continue;
+		fbbitword carry=0;
+		for (long ww=0; ww<m_words_per_row; ww++) {
+			fbbitword word=R[ww];
+			R[ww]=word|(word<<1)|carry; //the point i1 touches the elements i1-1 and i1
+			carry=word>>63;
+		}
+		for (int d3=0; d3<=1; d3++)
+		for (int d2=0; d2<=1; d2++) {
+			fbbitword *B=&m_bits.ptr[((i2+d2)+m_N2*(i3+d3))*m_words_per_row];
+			for (long ww=0; ww<m_words_per_row; ww++) B[ww]|=R[ww];
+		}
+	}
+}
+
+bool FBOccupancyBitmap::isOccupied(long i1,long i2,long i3) const {
+	return (index(i1,i2,i3)>=0);
+}
+
+long FBOccupancyBitmap::assignIndices(const QVector<long> &row_order) {
+	long ct=0;
+	for (long ii=0; ii<row_order.count(); ii++) {
+		long ww0=row_order[ii]*m_words_per_row;
+		for (long ww=ww0; ww<ww0+m_words_per_row; ww++) {
+			m_word_indices.ptr[ww]=ct;
+			ct+=FB_POPCOUNT(m_bits.ptr[ww]);
+		}
+	}
+	return ct;
+}
+
+long FBOccupancyBitmap::sliceCount(long i3) const {
+	if ((i3<0)||(i3>=m_N3)) return 0;
+	long ret=0;
+	long ww0=m_N2*i3*m_words_per_row;
+	for (long ww=ww0; ww<ww0+m_N2*m_words_per_row; ww++) ret+=FB_POPCOUNT(m_bits.ptr[ww]);
+	return ret;
+}
+
+long FBOccupancyBitmap::memoryBytes() const {
+	return m_bits.length()*sizeof(fbbitword)+m_word_indices.length()*sizeof(long);
+}
+
+void FBOccupancyBitmap::clear() {
+	m_bits.clear();
+	m_word_indices.clear();
+	m_N1=m_N2=m_N3=0;
+	m_words_per_row=0;
+}
@@ -0,0 +1,54 @@
+#ifndef fboccupancybitmap_H
+#define fboccupancybitmap_H
+
+#include "arrays.h"
+
+typedef unsigned long long fbbitword;
+
+#ifdef __GNUC__
+#define FB_POPCOUNT(x) __builtin_popcountll(x)
+#else
+inline int fb_popcount(fbbitword x) {
+	int ret=0;
+	while (x) {x&=x-1; ret++;}
+	return ret;
+}
+#define FB_POPCOUNT(x) fb_popcount(x)
+#endif
+
+//The occupied points of an N1xN2xN3 grid, numbered row by row (a row has fixed i2,i3 and is contiguous in i1).
+//Each row is stored as 64-bit words, and each word keeps the number of the first occupied point at or after
+//its start, so index() is a rank lookup: one word, one mask and one popcount. This takes about 2 bits
+//per grid point, instead of 64 for a dense array of indices.
+class FBOccupancyBitmap {
+public:
+	FBOccupancyBitmap();
+	void allocate(long N1,long N2,long N3); //all points unoccupied
+	void setOccupied(long i1,long i2,long i3);
+	void setFromElements(const FBArray3D<unsigned char> &elements); //allocates (M1+1)x(M2+1)x(M3+1) for M1xM2xM3 elements; the corners of the nonzero elements are occupied
+	bool isOccupied(long i1,long i2,long i3) const;
+	long assignIndices(const QVector<long> &row_order); //numbers the points, taking the rows (i2+N2*i3) in the given order; returns the number of occupied points
+	inline long index(long i1,long i2,long i3) const; //-1 if out of range or not occupied
+	long sliceCount(long i3) const; //number of occupied points with this i3
+	long memoryBytes() const;
+	void clear();
+	long N1() const {return m_N1;}
+	long N2() const {return m_N2;}
+	long N3() const {return m_N3;}
+private:
+	long m_N1,m_N2,m_N3;
+	long m_words_per_row;
+	FBArray1D<fbbitword> m_bits;
+	FBArray1D<long> m_word_indices; //number of the first occupied point at or after the start of each word
+};
+
+inline long FBOccupancyBitmap::index(long i1,long i2,long i3) const {
+	if ((i1<0)||(i1>=m_N1)||(i2<0)||(i2>=m_N2)||(i3<0)||(i3>=m_N3)) return -1;
+	long ww=(i2+m_N2*i3)*m_words_per_row+i1/64;
+	fbbitword bit=((fbbitword)1)<<(i1%64);
+	fbbitword word=m_bits.ptr[ww];
+	if (!(word&bit)) return -1;
+	return m_word_indices.ptr[ww]+FB_POPCOUNT(word&(bit-1));
+}
+
+#endif
@@ -1,5 +1,6 @@
 #include "fbsparsearray1d.h"
 #include <QDebug>
+#include <string.h>
 
 #define SPARSE_STAGE_EMPTY 0
 #define SPARSE_STAGE_ALLOCATED 1
@@ -33,59 +34,84 @@ public:
 	void finalize_step_2();
 	int find_offset_index(long blocknum,unsigned char offset);
 	void copy_from(const FBSparseArray1D &X);
+	void initialize();
 };
+
+template <class T>
+T *duplicate_array(const T *X,long N) {
+	if ((!X)||(!N)) return 0;
+	T *ret=(T *)malloc(sizeof(T)*N);
+	if (ret) memcpy(ret,X,sizeof(T)*N);
+	return ret;
+}
+
 void FBSparseArray1DPrivate::copy_from(const FBSparseArray1D &X) {
-	q->allocate(X.d->m_data_type,X.d->m_N);
-	
-	for (int pass=1; pass<=2; pass++) {
-		X.resetIteration();
-		while (X.advanceIteration()) {
-			q->setupIndex(pass,X.currentIndex());
-		}
-	}
-	
-	X.resetIteration();
-	while (X.advanceIteration()) {
-		q->setValue(X.currentValue(),X.currentIndex());
-	}
+	//copy the index structure and the values directly, rather than setting up the index again entry by entry
+	if (X.d==this) return;
+	q->clear();
+	FBSparseArray1DPrivate *D=X.d;
+	m_N=D->m_N;
+	m_block_count=D->m_block_count;
+	m_data_type=D->m_data_type;
+	m_stage=D->m_stage;
+	m_entry_count=D->m_entry_count;
+	m_last_step2_index=D->m_last_step2_index;
+	m_last_step2_index_in_block=D->m_last_step2_index_in_block;
+	m_has_error=D->m_has_error;
+	m_block_indices=duplicate_array(D->m_block_indices,D->m_block_count);
+	m_block_entry_counts=duplicate_array(D->m_block_entry_counts,D->m_block_count);
+	m_offsets=duplicate_array(D->m_offsets,D->m_entry_count);
+	m_data_float=duplicate_array(D->m_data_float,D->m_entry_count);
+	m_data_byte=duplicate_array(D->m_data_byte,D->m_entry_count);
+}
+
+void FBSparseArray1DPrivate::initialize() {
+	m_N=0;
+	m_data_type=DATA_TYPE_FLOAT;
+	m_stage=SPARSE_STAGE_EMPTY;
+	m_data_byte=0;
+	m_data_float=0;
+	m_offsets=0;
+	m_block_indices=0;
+	m_block_entry_counts=0;
+	m_entry_count=0;
+	m_block_count=0;
+	m_has_error=false;
+	m_current_block_index=0;
+	m_current_index_in_block=0;
+	m_last_step2_index=-1;
+	m_last_step2_index_in_block=-1;
 }
 
 FBSparseArray1D::FBSparseArray1D() 
 {
 	d=new FBSparseArray1DPrivate;
 	d->q=this;
-	d->m_N=0;
-	d->m_data_type=DATA_TYPE_FLOAT;
-	d->m_stage=SPARSE_STAGE_EMPTY;
-	d->m_data_byte=0;
-	d->m_data_float=0;
-	d->m_offsets=0;
-	d->m_block_indices=0;
-	d->m_block_entry_counts=0;
-	d->m_entry_count=0;
-	d->m_block_count=0;
-	d->m_has_error=false;
-	d->m_current_block_index=0;
-	d->m_current_index_in_block=0;
+	d->initialize();
 }
 FBSparseArray1D::FBSparseArray1D(const FBSparseArray1D &X) {
 	d=new FBSparseArray1DPrivate;
 	d->q=this;
-	d->m_N=0;
-	d->m_data_type=DATA_TYPE_FLOAT;
-	d->m_stage=SPARSE_STAGE_EMPTY;
-	d->m_data_byte=0;
-	d->m_data_float=0;
-	d->m_offsets=0;
-	d->m_block_indices=0;
-	d->m_block_entry_counts=0;
-	d->m_entry_count=0;
-	d->m_block_count=0;
-	d->m_has_error=false;
-	d->m_current_block_index=0;
-	d->m_current_index_in_block=0;
+	d->initialize();
 	d->copy_from(X);
 }
+#ifdef Q_COMPILER_RVALUE_REFS
+FBSparseArray1D::FBSparseArray1D(FBSparseArray1D &&X) {
+	d=new FBSparseArray1DPrivate;
+	d->q=this;
+	d->initialize();
+	swap(X);
+}
+void FBSparseArray1D::operator=(FBSparseArray1D &&X) {
+	clear();
+	swap(X);
+}
+#endif
+void FBSparseArray1D::swap(FBSparseArray1D &X) {
+	FBSparseArray1DPrivate *tmp=d; d=X.d; X.d=tmp;
+	d->q=this;
+	X.d->q=&X;
+}
 FBSparseArray1D::~FBSparseArray1D()
 {
 	clear();
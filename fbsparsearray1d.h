@@ -11,7 +11,12 @@ public:
 	FBSparseArray1D();
 	FBSparseArray1D(const FBSparseArray1D &X);
 	void operator=(const FBSparseArray1D &X);
+#ifdef Q_COMPILER_RVALUE_REFS
+	FBSparseArray1D(FBSparseArray1D &&X); //takes over the data of X, leaving X empty
+	void operator=(FBSparseArray1D &&X);
+#endif
 	virtual ~FBSparseArray1D();
+	void swap(FBSparseArray1D &X); //exchanges the data without copying
 	void allocate(int data_type,long N);
 	bool setupIndex(int pass,long ind); //pass=1,2
 	void clear();
@@ -47,6 +47,25 @@ FBSparseArray4D::FBSparseArray4D(const FBSparseArray4D &X) {
 void FBSparseArray4D::operator=(const FBSparseArray4D &X) {
 	d->copy_from(X);
 }
+#ifdef Q_COMPILER_RVALUE_REFS
+FBSparseArray4D::FBSparseArray4D(FBSparseArray4D &&X) {
+	d=new FBSparseArray4DPrivate;
+	d->q=this;
+	d->m_N1=d->m_N2=d->m_N3=d->m_N4=0;
+	d->m_N1N2=d->m_N1N2N3=d->m_N1N2N3N4=0;
+	swap(X);
+}
+void FBSparseArray4D::operator=(FBSparseArray4D &&X) {
+	FBSparseArray4D tmp;
+	swap(tmp);
+	swap(X);
+}
+#endif
+void FBSparseArray4D::swap(FBSparseArray4D &X) {
+	FBSparseArray4DPrivate *tmp=d; d=X.d; X.d=tmp;
+	d->q=this;
+	X.d->q=&X;
+}
 
 FBSparseArray4D::~FBSparseArray4D()
 {
@@ -10,7 +10,12 @@ public:
 	FBSparseArray4D();
 	FBSparseArray4D(const FBSparseArray4D &X);
 	void operator=(const FBSparseArray4D &X);
+#ifdef Q_COMPILER_RVALUE_REFS
+	FBSparseArray4D(FBSparseArray4D &&X); //takes over the data of X, leaving X empty
+	void operator=(FBSparseArray4D &&X);
+#endif
 	virtual ~FBSparseArray4D();
+	void swap(FBSparseArray4D &X); //exchanges the data without copying
 	void allocate(int data_type,int N1,int N2,int N3,int N4);
 	bool setupIndex(int pass,long i1,long i2,long i3,long i4); //pass=1,2
 	void setValue(float val,long i1,long i2,long i3,long i4);
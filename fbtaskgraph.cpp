@@ -0,0 +1,180 @@
+#include "fbtaskgraph.h"
+#include "fbcputopology.h"
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QQueue>
+#include <QVector>
+
+struct FBTaskGraphNode {
+	FBGraphTask *task;
+	int thread_index; //-1 for any thread
+	int num_dependencies;
+	int num_pending; //dependencies that are not done yet in the current run
+	QList<int> successors;
+};
+
+struct FBTaskGraphThreadState {
+	QQueue<int> ready; //ready tasks bound to the thread
+	QList<int> cpus;
+	bool cpus_changed;
+};
+
+class FBTaskGraphThread : public QThread {
+public:
+	FBTaskGraphPrivate *graph;
+	int thread_index;
+	void run();
+};
+
+class FBTaskGraphPrivate {
+public:
+	FBTaskGraph *q;
+	QList<FBTaskGraphThread *> m_threads;
+	QVector<FBTaskGraphNode> m_nodes;
+	QList<FBTaskGraphThreadState> m_states;
+	QQueue<int> m_ready_any; //ready tasks that any thread can take
+	QMutex m_mutex;
+	QWaitCondition m_work;
+	QWaitCondition m_done;
+	int m_num_done;
+	bool m_quit;
+
+	void stop_threads();
+	void make_ready(int id); //called with m_mutex locked
+};
+
+void FBTaskGraphThread::run() {
+	graph->m_mutex.lock();
+	while (true) {
+		if (graph->m_quit) break;
+		FBTaskGraphThreadState &S=graph->m_states[thread_index];
+		if (S.cpus_changed) {
+			QList<int> cpus=S.cpus;
+			S.cpus_changed=false;
+			graph->m_mutex.unlock();
+			fb_pin_current_thread(cpus);
+			graph->m_mutex.lock();
+			continue;
+		}
+		int id=-1;
+		if (!S.ready.isEmpty()) id=S.ready.dequeue();
+		else if (!graph->m_ready_any.isEmpty()) id=graph->m_ready_any.dequeue();
+		if (id<0) {
+			graph->m_work.wait(&graph->m_mutex);
+			continue;
+		}
+		FBGraphTask *task=graph->m_nodes[id].task;
+		graph->m_mutex.unlock();
+
+		task->run();
+
+		graph->m_mutex.lock();
+		QList<int> successors=graph->m_nodes[id].successors;
+		for (int i=0; i<successors.count(); i++) {
+			graph->m_nodes[successors[i]].num_pending--;
+			if (!graph->m_nodes[successors[i]].num_pending) graph->make_ready(successors[i]);
+		}
+		graph->m_num_done++;
+		if (graph->m_num_done==graph->m_nodes.count()) graph->m_done.wakeAll();
+	}
+	graph->m_mutex.unlock();
+}
+
+FBTaskGraph::FBTaskGraph()
+{
+	d=new FBTaskGraphPrivate;
+	d->q=this;
+	d->m_num_done=0;
+	d->m_quit=false;
+}
+
+FBTaskGraph::~FBTaskGraph()
+{
+	d->stop_threads();
+	delete d;
+}
+
+void FBTaskGraphPrivate::stop_threads() {
+	m_mutex.lock();
+	m_quit=true;
+	m_work.wakeAll();
+	m_mutex.unlock();
+	for (int i=0; i<m_threads.count(); i++) {
+		m_threads[i]->wait();
+		delete m_threads[i];
+	}
+	m_threads.clear();
+	m_states.clear();
+	m_quit=false;
+}
+
+void FBTaskGraphPrivate::make_ready(int id) {
+	int thread_index=m_nodes[id].thread_index;
+	if (thread_index<0) m_ready_any.enqueue(id);
+	else m_states[thread_index%m_threads.count()].ready.enqueue(id);
+	m_work.wakeAll();
+}
+
+void FBTaskGraph::setThreadCount(int num) {
+	if (num<1) num=1;
+	if (num==threadCount()) return;
+	d->stop_threads();
+	for (int i=0; i<num; i++) {
+		FBTaskGraphThreadState S;
+		S.cpus_changed=false;
+		d->m_states << S;
+	}
+	for (int i=0; i<num; i++) {
+		FBTaskGraphThread *T=new FBTaskGraphThread;
+		T->graph=d;
+		T->thread_index=i;
+		d->m_threads << T;
+		T->start();
+	}
+}
+
+int FBTaskGraph::threadCount() const {
+	return d->m_threads.count();
+}
+
+void FBTaskGraph::setThreadCpus(int thread_index,const QList<int> &cpus) {
+	QMutexLocker locker(&d->m_mutex);
+	if ((thread_index<0)||(thread_index>=d->m_threads.count())) return;
+	FBTaskGraphThreadState &S=d->m_states[thread_index];
+	if (cpus==S.cpus) return;
+	S.cpus=cpus;
+	S.cpus_changed=!cpus.isEmpty();
+	d->m_work.wakeAll();
+}
+
+void FBTaskGraph::clear() {
+	d->m_nodes.clear();
+}
+
+int FBTaskGraph::addTask(FBGraphTask *task,int thread_index) {
+	FBTaskGraphNode N;
+	N.task=task;
+	N.thread_index=thread_index;
+	N.num_dependencies=0;
+	N.num_pending=0;
+	d->m_nodes << N;
+	return d->m_nodes.count()-1;
+}
+
+void FBTaskGraph::addDependency(int before,int after) {
+	d->m_nodes[before].successors << after;
+	d->m_nodes[after].num_dependencies++;
+}
+
+void FBTaskGraph::run() {
+	if (d->m_threads.isEmpty()) setThreadCount(1);
+	QMutexLocker locker(&d->m_mutex);
+	if (d->m_nodes.isEmpty()) return;
+	d->m_num_done=0;
+	for (int i=0; i<d->m_nodes.count(); i++) d->m_nodes[i].num_pending=d->m_nodes[i].num_dependencies;
+	for (int i=0; i<d->m_nodes.count(); i++) {
+		if (!d->m_nodes[i].num_dependencies) d->make_ready(i);
+	}
+	while (d->m_num_done<d->m_nodes.count()) d->m_done.wait(&d->m_mutex);
+}
@@ -0,0 +1,33 @@
+#ifndef fbtaskgraph_H
+#define fbtaskgraph_H
+
+#include <QList>
+
+//A piece of work in an FBTaskGraph
+class FBGraphTask {
+public:
+	virtual ~FBGraphTask() {}
+	virtual void run()=0;
+};
+
+//Runs a set of tasks on a fixed set of threads (which stay alive between runs), each task as soon as the tasks
+//it depends on are done, instead of in phases that all threads finish before the next one starts.
+//A task can be bound to one of the threads, so that the same data is worked on by the same thread (and cpus) every time.
+class FBTaskGraphPrivate;
+class FBTaskGraph {
+public:
+	friend class FBTaskGraphPrivate;
+	FBTaskGraph();
+	virtual ~FBTaskGraph();
+	void setThreadCount(int num);
+	int threadCount() const;
+	void setThreadCpus(int thread_index,const QList<int> &cpus); //pins the thread to these cpus before its next task
+	void clear(); //removes all tasks (without deleting them)
+	int addTask(FBGraphTask *task,int thread_index=-1); //-1 for any thread; returns the id of the task
+	void addDependency(int before,int after); //the task after only starts once the task before is done
+	void run(); //runs every task once and returns when all are done (the calling thread only waits)
+private:
+	FBTaskGraphPrivate *d;
+};
+
+#endif
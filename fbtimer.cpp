@@ -2,6 +2,7 @@
 #include <QTime>
 #include <QHash>
 #include <QStringList>
+#include <QMutex>
 
 struct TimerData {
 	long ms_elapsed;
@@ -12,6 +13,7 @@ class FBTimerPrivate {
 public:
 	FBTimer *q;
 	QHash<QString,TimerData> m_timers;
+	QMutex m_mutex; //the timers are started and stopped from the block threads
 };
 
 FBTimer::FBTimer() 
@@ -26,6 +28,7 @@ FBTimer::~FBTimer()
 }
 void FBTimer::startTimer(QString timer_name) {
 	FBTimerPrivate *dd=instance()->d;
+	QMutexLocker locker(&dd->m_mutex);
 	if (!dd->m_timers.contains(timer_name)) {
 		TimerData TD;
 		TD.ms_elapsed=0;
@@ -35,6 +38,7 @@ void FBTimer::startTimer(QString timer_name) {
 }
 void FBTimer::stopTimer(QString timer_name) {
 	FBTimerPrivate *dd=instance()->d;
+	QMutexLocker locker(&dd->m_mutex);
 	if (!dd->m_timers.contains(timer_name)) return;
 	dd->m_timers[timer_name].ms_elapsed+=dd->m_timers[timer_name].time.restart();
 }
@@ -45,11 +49,13 @@ FBTimer *FBTimer::instance() {
 }
 double FBTimer::elapsed(QString timer_name) {
 	FBTimerPrivate *dd=instance()->d;
+	QMutexLocker locker(&dd->m_mutex);
 	if (!dd->m_timers.contains(timer_name)) return 0;
 	return dd->m_timers[timer_name].ms_elapsed/1000.0;
 }
 QStringList FBTimer::timerNames() {
 	FBTimerPrivate *dd=instance()->d;
+	QMutexLocker locker(&dd->m_mutex);
 	QStringList ret=dd->m_timers.keys();
 	qSort(ret);
 	return ret;
@@ -0,0 +1,197 @@
+#include "fbvectorkernels.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define FB_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+//the update of fused_step_B_update_with_moments goes through the vectors in pieces of this many variables (a multiple of 12),
+//and the moments of each piece are taken while its r is still in the L1 cache
+#define MOMENTS_CHUNK_SIZE 96
+
+#ifdef FB_USE_SSE2
+//adds the four single precision values of X to the two double precision accumulators
+inline void accumulate_ps(__m128d &acc_lo,__m128d &acc_hi,__m128 X) {
+	acc_lo=_mm_add_pd(acc_lo,_mm_cvtps_pd(X));
+	acc_hi=_mm_add_pd(acc_hi,_mm_cvtps_pd(_mm_movehl_ps(X,X)));
+}
+inline double horizontal_sum(__m128d acc_lo,__m128d acc_hi) {
+	double vals[2];
+	_mm_storeu_pd(vals,_mm_add_pd(acc_lo,acc_hi));
+	return vals[0]+vals[1];
+}
+#endif
+
+template <bool PRECONDITIONED>
+void fused_step_A_products_template(FBStepAProducts &ret,long begin,long end,const float *r,const float *p,const float *Ap,const float *C) {
+	double r_z=0,r_Ap=0,Ap_Ap=0,p_Ap=0;
+	long ii=begin;
+#ifdef FB_USE_SSE2
+	__m128d r_z_lo=_mm_setzero_pd(),r_z_hi=_mm_setzero_pd();
+	__m128d r_Ap_lo=_mm_setzero_pd(),r_Ap_hi=_mm_setzero_pd();
+	__m128d Ap_Ap_lo=_mm_setzero_pd(),Ap_Ap_hi=_mm_setzero_pd();
+	__m128d p_Ap_lo=_mm_setzero_pd(),p_Ap_hi=_mm_setzero_pd();
+	for (; ii+4<=end; ii+=4) {
+		__m128 rr=_mm_loadu_ps(&r[ii]);
+		__m128 pp=_mm_loadu_ps(&p[ii]);
+		__m128 AA=_mm_loadu_ps(&Ap[ii]);
+		__m128 zz=rr;
+		__m128 BB=AA;
+		if (PRECONDITIONED) {
+			__m128 CC=_mm_loadu_ps(&C[ii]);
+			zz=_mm_div_ps(rr,CC);
+			BB=_mm_div_ps(AA,CC);
+		}
+		accumulate_ps(r_z_lo,r_z_hi,_mm_mul_ps(rr,zz));
+		accumulate_ps(r_Ap_lo,r_Ap_hi,_mm_mul_ps(rr,BB));
+		accumulate_ps(Ap_Ap_lo,Ap_Ap_hi,_mm_mul_ps(AA,BB));
+		accumulate_ps(p_Ap_lo,p_Ap_hi,_mm_mul_ps(pp,AA));
+	}
+	r_z=horizontal_sum(r_z_lo,r_z_hi);
+	r_Ap=horizontal_sum(r_Ap_lo,r_Ap_hi);
+	Ap_Ap=horizontal_sum(Ap_Ap_lo,Ap_Ap_hi);
+	p_Ap=horizontal_sum(p_Ap_lo,p_Ap_hi);
+#endif
+	for (; ii<end; ii++) {
+		float zz=r[ii];
+		float BB=Ap[ii];
+		if (PRECONDITIONED) {
+			zz=r[ii]/C[ii];
+			BB=Ap[ii]/C[ii];
+		}
+		r_z+=r[ii]*zz;
+		r_Ap+=r[ii]*BB;
+		Ap_Ap+=Ap[ii]*BB;
+		p_Ap+=p[ii]*Ap[ii];
+	}
+	ret.r_z=r_z;
+	ret.r_Ap=r_Ap;
+	ret.Ap_Ap=Ap_Ap;
+	ret.p_Ap=p_Ap;
+}
+
+template <bool PRECONDITIONED>
+void interleaved_step_A_products_template(FBStepAProducts &ret,long begin,long end,const float *r,const float *p,const float *Ap,const float *C,long vertex_stride) {
+	//one vertex at a time, so that its r, p and Ap come from the same cache line
+	double r_z=0,r_Ap=0,Ap_Ap=0,p_Ap=0;
+	for (long ii=begin; ii<end; ii+=3) {
+		long pos=(ii/3)*vertex_stride;
+		for (int dd=0; dd<3; dd++) {
+			float rr=r[pos+dd];
+			float AA=Ap[pos+dd];
+			float zz=rr;
+			float BB=AA;
+			if (PRECONDITIONED) {
+				zz=rr/C[ii+dd];
+				BB=AA/C[ii+dd];
+			}
+			r_z+=rr*zz;
+			r_Ap+=rr*BB;
+			Ap_Ap+=AA*BB;
+			p_Ap+=p[pos+dd]*AA;
+		}
+	}
+	ret.r_z=r_z;
+	ret.r_Ap=r_Ap;
+	ret.Ap_Ap=Ap_Ap;
+	ret.p_Ap=p_Ap;
+}
+
+void fused_step_A_products(FBStepAProducts &ret,long begin,long end,const float *r,const float *p,const float *Ap,const float *C,long vertex_stride) {
+	if (vertex_stride!=3) {
+		if (C) interleaved_step_A_products_template<true>(ret,begin,end,r,p,Ap,C,vertex_stride);
+		else interleaved_step_A_products_template<false>(ret,begin,end,r,p,Ap,C,vertex_stride);
+	}
+	else if (C) fused_step_A_products_template<true>(ret,begin,end,r,p,Ap,C);
+	else fused_step_A_products_template<false>(ret,begin,end,r,p,Ap,C);
+}
+
+template <bool PRECONDITIONED>
+double fused_step_B_update_template(long begin,long end,float *x,float *r,float *p,const float *Ap,const float *C,double alpha,double beta) {
+	double r_r=0;
+	long ii=begin;
+#ifdef FB_USE_SSE2
+	//the updates are done in double precision, as in the scalar loop
+	__m128d alpha_pd=_mm_set1_pd(alpha);
+	__m128d beta_pd=_mm_set1_pd(beta);
+	__m128d r_r_lo=_mm_setzero_pd(),r_r_hi=_mm_setzero_pd();
+	for (; ii+4<=end; ii+=4) {
+		__m128 rr=_mm_loadu_ps(&r[ii]);
+		__m128 AA=_mm_loadu_ps(&Ap[ii]);
+		__m128 xx=_mm_loadu_ps(&x[ii]);
+		__m128 pp=_mm_loadu_ps(&p[ii]);
+		__m128d r_lo=_mm_sub_pd(_mm_cvtps_pd(rr),_mm_mul_pd(_mm_cvtps_pd(AA),alpha_pd));
+		__m128d r_hi=_mm_sub_pd(_mm_cvtps_pd(_mm_movehl_ps(rr,rr)),_mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(AA,AA)),alpha_pd));
+		rr=_mm_movelh_ps(_mm_cvtpd_ps(r_lo),_mm_cvtpd_ps(r_hi));
+		__m128d p_lo=_mm_cvtps_pd(pp);
+		__m128d p_hi=_mm_cvtps_pd(_mm_movehl_ps(pp,pp));
+		__m128d x_lo=_mm_add_pd(_mm_cvtps_pd(xx),_mm_mul_pd(p_lo,alpha_pd));
+		__m128d x_hi=_mm_add_pd(_mm_cvtps_pd(_mm_movehl_ps(xx,xx)),_mm_mul_pd(p_hi,alpha_pd));
+		__m128 zz=rr;
+		if (PRECONDITIONED) zz=_mm_div_ps(rr,_mm_loadu_ps(&C[ii]));
+		p_lo=_mm_add_pd(_mm_mul_pd(p_lo,beta_pd),_mm_cvtps_pd(zz));
+		p_hi=_mm_add_pd(_mm_mul_pd(p_hi,beta_pd),_mm_cvtps_pd(_mm_movehl_ps(zz,zz)));
+		_mm_storeu_ps(&r[ii],rr);
+		_mm_storeu_ps(&x[ii],_mm_movelh_ps(_mm_cvtpd_ps(x_lo),_mm_cvtpd_ps(x_hi)));
+		_mm_storeu_ps(&p[ii],_mm_movelh_ps(_mm_cvtpd_ps(p_lo),_mm_cvtpd_ps(p_hi)));
+		accumulate_ps(r_r_lo,r_r_hi,_mm_mul_ps(rr,rr));
+	}
+	r_r=horizontal_sum(r_r_lo,r_r_hi);
+#endif
+	for (; ii<end; ii++) {
+		r[ii]=r[ii]-Ap[ii]*alpha;
+		x[ii]=x[ii]+p[ii]*alpha;
+		if (PRECONDITIONED) p[ii]=p[ii]*beta+r[ii]/C[ii];
+		else p[ii]=p[ii]*beta+r[ii];
+		r_r+=r[ii]*r[ii];
+	}
+	return r_r;
+}
+
+template <bool PRECONDITIONED>
+double interleaved_step_B_update_template(long begin,long end,float *x,float *r,float *p,const float *Ap,const float *C,double alpha,double beta,long vertex_stride) {
+	double r_r=0;
+	for (long ii=begin; ii<end; ii+=3) {
+		long pos=(ii/3)*vertex_stride;
+		for (int dd=0; dd<3; dd++) {
+			float rr=r[pos+dd]-Ap[pos+dd]*alpha;
+			r[pos+dd]=rr;
+			x[pos+dd]=x[pos+dd]+p[pos+dd]*alpha;
+			if (PRECONDITIONED) p[pos+dd]=p[pos+dd]*beta+rr/C[ii+dd];
+			else p[pos+dd]=p[pos+dd]*beta+rr;
+			r_r+=rr*rr;
+		}
+	}
+	return r_r;
+}
+
+double fused_step_B_update(long begin,long end,float *x,float *r,float *p,const float *Ap,const float *C,double alpha,double beta,long vertex_stride) {
+	if (vertex_stride!=3) {
+		if (C) return interleaved_step_B_update_template<true>(begin,end,x,r,p,Ap,C,alpha,beta,vertex_stride);
+		else return interleaved_step_B_update_template<false>(begin,end,x,r,p,Ap,C,alpha,beta,vertex_stride);
+	}
+	else if (C) return fused_step_B_update_template<true>(begin,end,x,r,p,Ap,C,alpha,beta);
+	else return fused_step_B_update_template<false>(begin,end,x,r,p,Ap,C,alpha,beta);
+}
+
+double fused_step_B_update_with_moments(long begin,long end,float *x,float *r,float *p,const float *Ap,const float *C,double alpha,double beta,long vertex_stride,const float *arms,double moments[9]) {
+	double r_r=0;
+	double M[9]; //local, so that the compiler can keep the sums in registers
+	for (int kk=0; kk<9; kk++) M[kk]=0;
+	for (long ii=begin; ii<end; ii+=MOMENTS_CHUNK_SIZE) {
+		long chunk_end=ii+MOMENTS_CHUNK_SIZE;
+		if (chunk_end>end) chunk_end=end;
+		r_r+=fused_step_B_update(ii,chunk_end,x,r,p,Ap,C,alpha,beta,vertex_stride);
+		for (long jj=ii; jj<chunk_end; jj+=3) {
+			const float *R=&r[(jj/3)*vertex_stride];
+			const float *L=&arms[jj];
+			for (int dd=0; dd<3; dd++) {
+				M[dd*3+0]+=R[dd]*L[0];
+				M[dd*3+1]+=R[dd]*L[1];
+				M[dd*3+2]+=R[dd]*L[2];
+			}
+		}
+	}
+	for (int kk=0; kk<9; kk++) moments[kk]+=M[kk];
+	return r_r;
+}
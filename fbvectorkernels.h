@@ -0,0 +1,28 @@
+#ifndef fbvectorkernels_H
+#define fbvectorkernels_H
+
+//Fused vector kernels for the CG iteration of FBBlock. Each kernel makes a single pass over its vectors.
+//The products are formed in single precision and accumulated in double precision.
+//C is the preconditioner (the diagonal of A), or 0 when no preconditioner is used.
+//The value of variable ii of r, p, x and Ap is at position (ii/3)*vertex_stride+ii%3 (vertex_stride=3 for contiguous
+//vectors, 12 when the four vectors are interleaved per vertex), while C is always contiguous.
+//With vertex_stride!=3, begin and end must be multiples of 3.
+
+struct FBStepAProducts {
+	double r_z;
+	double r_Ap;
+	double Ap_Ap;
+	double p_Ap;
+};
+
+//r_z=sum(r*r/C), r_Ap=sum(r*Ap/C), Ap_Ap=sum(Ap*Ap/C), p_Ap=sum(p*Ap) over the indices [begin,end)
+void fused_step_A_products(FBStepAProducts &ret,long begin,long end,const float *r,const float *p,const float *Ap,const float *C,long vertex_stride);
+
+//r=r-alpha*Ap, x=x+alpha*p, p=beta*p+r/C over the indices [begin,end); returns sum(r*r) of the updated r
+double fused_step_B_update(long begin,long end,float *x,float *r,float *p,const float *Ap,const float *C,double alpha,double beta,long vertex_stride);
+
+//as fused_step_B_update, and also adds the first moments of the updated r to moments: moments[3*dd+ee]+=sum(r_dd*arms_ee),
+//where arms holds the 3 lever arms of each vertex (contiguous, like C), so the rows are still only read once
+double fused_step_B_update_with_moments(long begin,long end,float *x,float *r,float *p,const float *Ap,const float *C,double alpha,double beta,long vertex_stride,const float *arms,double moments[9]);
+
+#endif
@@ -0,0 +1,117 @@
+#include "fbworkerteam.h"
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QList>
+
+class FBWorkerThread : public QThread {
+public:
+	FBWorkerTeamPrivate *team;
+	int thread_index;
+	void run();
+};
+
+class FBWorkerTeamPrivate {
+public:
+	FBWorkerTeam *q;
+	QList<FBWorkerThread *> m_threads;
+	QMutex m_mutex;
+	QWaitCondition m_task_ready;
+	QWaitCondition m_task_done;
+	FBWorkerTask *m_task;
+	long m_generation; //incremented for every task, so the workers know when there is something new
+	int m_num_running;
+	bool m_quit;
+
+	void stop_threads();
+};
+
+void FBWorkerThread::run() {
+	long generation=0;
+	while (true) {
+		team->m_mutex.lock();
+		while ((team->m_generation==generation)&&(!team->m_quit)) {
+			team->m_task_ready.wait(&team->m_mutex);
+		}
+		if (team->m_quit) {
+			team->m_mutex.unlock();
+			return;
+		}
+		generation=team->m_generation;
+		FBWorkerTask *task=team->m_task;
+		team->m_mutex.unlock();
+
+		task->run(thread_index);
+
+		team->m_mutex.lock();
+		team->m_num_running--;
+		if (!team->m_num_running) team->m_task_done.wakeAll();
+		team->m_mutex.unlock();
+	}
+}
+
+FBWorkerTeam::FBWorkerTeam()
+{
+	d=new FBWorkerTeamPrivate;
+	d->q=this;
+	d->m_task=0;
+	d->m_generation=0;
+	d->m_num_running=0;
+	d->m_quit=false;
+}
+
+FBWorkerTeam::~FBWorkerTeam()
+{
+	d->stop_threads();
+	delete d;
+}
+
+void FBWorkerTeamPrivate::stop_threads() {
+	m_mutex.lock();
+	m_quit=true;
+	m_task_ready.wakeAll();
+	m_mutex.unlock();
+	for (int i=0; i<m_threads.count(); i++) {
+		m_threads[i]->wait();
+		delete m_threads[i];
+	}
+	m_threads.clear();
+	m_quit=false;
+}
+
+void FBWorkerTeam::setThreadCount(int num) {
+	if (num<1) num=1;
+	if (num==threadCount()) return;
+	d->stop_threads();
+	d->m_generation=0;
+	for (int i=1; i<num; i++) {
+		FBWorkerThread *T=new FBWorkerThread;
+		T->team=d;
+		T->thread_index=i;
+		d->m_threads << T;
+		T->start();
+	}
+}
+
+int FBWorkerTeam::threadCount() const {
+	return d->m_threads.count()+1;
+}
+
+void FBWorkerTeam::run(FBWorkerTask *task) {
+	if (d->m_threads.isEmpty()) {
+		task->run(0);
+		return;
+	}
+	d->m_mutex.lock();
+	d->m_task=task;
+	d->m_num_running=d->m_threads.count();
+	d->m_generation++;
+	d->m_task_ready.wakeAll();
+	d->m_mutex.unlock();
+
+	task->run(0);
+
+	d->m_mutex.lock();
+	while (d->m_num_running) d->m_task_done.wait(&d->m_mutex);
+	d->m_mutex.unlock();
+}
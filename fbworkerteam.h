@@ -0,0 +1,26 @@
+#ifndef fbworkerteam_H
+#define fbworkerteam_H
+
+//A piece of work that is run by every thread of an FBWorkerTeam
+class FBWorkerTask {
+public:
+	virtual ~FBWorkerTask() {}
+	virtual void run(int thread_index)=0;
+};
+
+//A fixed set of threads that stay alive between tasks, so that a block can split
+//its element loops over several threads without creating threads every time
+class FBWorkerTeamPrivate;
+class FBWorkerTeam {
+public:
+	friend class FBWorkerTeamPrivate;
+	FBWorkerTeam();
+	virtual ~FBWorkerTeam();
+	void setThreadCount(int num); //including the calling thread
+	int threadCount() const;
+	void run(FBWorkerTask *task); //runs task->run(i) for i=0..threadCount()-1 (i=0 on the calling thread) and waits for all of them
+private:
+	FBWorkerTeamPrivate *d;
+};
+
+#endif
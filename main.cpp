@@ -19,6 +19,7 @@
 #include <QFile>
 
 #include "fbblocksolver.h"
+#include "fbcputopology.h"
 #include "fbblock.h"
 #include "fbparameterfile.h"
 
@@ -140,16 +141,47 @@ int main(int argc, char *argv[])
 		Solver.setEpsilon(PF.getReal("EPSILON"));
 	}
 	
+	//CONVERGENCE STRESS COMPONENTS
+	if (PF.getString("CONVERGENCE STRESS COMPONENTS")=="all") {
+		printf("Estimating the error from all stress components...\n");
+		Solver.errorEstimator()->setTrackAllComponents(true);
+	}
+	
 	//MAX ITERATIONS
 	//if (PF.getInteger("MAX ITERATIONS")>0) {
 		printf("Setting max iterations = %d\n",PF.getInteger("MAX ITERATIONS"));
 		Solver.setMaxIterations(PF.getInteger("MAX ITERATIONS"));
 	//}
 	
-	//NUM THREADS
-	if (PF.getInteger("NUM THREADS")>0) {
-		printf("Setting num threads = %d\n",PF.getInteger("NUM THREADS"));
-		Solver.setNumThreads(PF.getInteger("NUM THREADS"));
+	//NUM THREADS, USE SMT, PIN THREADS
+	{
+		FBCpuTopology topology;
+		bool use_smt=(PF.getString("USE SMT")=="yes");
+		int threads_per_block=qMax(PF.getInteger("THREADS PER BLOCK"),1);
+		int num_threads=1;
+		bool threads_given=true;
+		if (PF.getString("NUM THREADS")=="auto") {
+			printf("Found %d logical CPUs, %d physical cores, %d NUMA nodes available to this process.\n",topology.logicalCpuCount(),topology.physicalCoreCount(),topology.numaNodeCount());
+			num_threads=qMax(topology.workerCpus(use_smt).count()/threads_per_block,1);
+			printf("Setting num threads = %d\n",num_threads);
+			Solver.setNumThreads(num_threads);
+		}
+		else if (PF.getInteger("NUM THREADS")>0) {
+			num_threads=PF.getInteger("NUM THREADS");
+			printf("Setting num threads = %d\n",num_threads);
+			Solver.setNumThreads(num_threads);
+		}
+		else threads_given=false;
+		//one thread per physical core unless there are more threads than cores (or USE SMT=yes);
+		//a run without NUM THREADS is left to the scheduler
+		if ((threads_given)&&(PF.getString("PIN THREADS")!="no")&&(topology.isFromSystem())) {
+			QList<int> cpus=topology.workerCpus(use_smt);
+			if (num_threads*threads_per_block>cpus.count()) cpus=topology.workerCpus(true);
+			if (num_threads*threads_per_block<=cpus.count()) {
+				printf("Pinning the threads to %d cpus...\n",num_threads*threads_per_block);
+				Solver.setThreadCpus(cpus);
+			}
+		}
 	}
 	
 	//PRECONDITIONER
@@ -159,6 +191,85 @@ int main(int argc, char *argv[])
 	}
 	else Solver.setUsePreconditioner(false);
 	
+	//ASSEMBLED OPERATOR, OPERATOR MEMORY BUDGET
+	if (PF.getString("ASSEMBLED OPERATOR")=="yes") {
+		printf("Using assembled operator...\n");
+		Solver.setOperatorMode(OPERATOR_MODE_ASSEMBLED);
+	}
+	else if (PF.getString("ASSEMBLED OPERATOR")=="no") {
+		Solver.setOperatorMode(OPERATOR_MODE_MATRIX_FREE);
+	}
+	else Solver.setOperatorMode(OPERATOR_MODE_AUTO);
+	if (PF.getReal("OPERATOR MEMORY BUDGET")>0) {
+		printf("Setting operator memory budget = %g MB\n",PF.getReal("OPERATOR MEMORY BUDGET"));
+		Solver.setOperatorMemoryBudget(PF.getReal("OPERATOR MEMORY BUDGET"));
+	}
+	
+	//VARIABLE ORDERING
+	if (PF.getString("VARIABLE ORDERING")=="morton") {
+		printf("Using Morton ordering of the block variables...\n");
+		Solver.setVariableOrdering(VARIABLE_ORDERING_MORTON);
+	}
+	else Solver.setVariableOrdering(VARIABLE_ORDERING_LEXICOGRAPHIC);
+	
+	//VECTOR LAYOUT
+	if (PF.getString("VECTOR LAYOUT")=="interleaved") {
+		printf("Using interleaved storage of the CG vectors...\n");
+		Solver.setVectorLayout(VECTOR_LAYOUT_INTERLEAVED);
+	}
+	else Solver.setVectorLayout(VECTOR_LAYOUT_SPLIT);
+	
+	//SCRATCH DIRECTORY, NUM BLOCKS
+	if (!PF.getString("SCRATCH DIRECTORY").isEmpty()) {
+		printf("Keeping the block arrays in scratch files in %s...\n",PF.getString("SCRATCH DIRECTORY").toAscii().data());
+		Solver.setScratchDirectory(PF.getString("SCRATCH DIRECTORY"));
+	}
+	if (PF.getInteger("NUM BLOCKS")>0) {
+		printf("Setting number of blocks = %d\n",PF.getInteger("NUM BLOCKS"));
+		Solver.setNumBlocks(PF.getInteger("NUM BLOCKS"));
+	}
+	
+	//REBALANCE ITERATIONS, REBALANCE THRESHOLD
+	if (PF.getInteger("REBALANCE ITERATIONS")>0) {
+		fbreal threshold=1.1F;
+		if (PF.getReal("REBALANCE THRESHOLD")>1) threshold=PF.getReal("REBALANCE THRESHOLD");
+		printf("Rebalancing the blocks after %d iterations if the imbalance exceeds %g...\n",PF.getInteger("REBALANCE ITERATIONS"),threshold);
+		Solver.setRebalancing(PF.getInteger("REBALANCE ITERATIONS"),threshold);
+	}
+	
+	//LOW MEMORY
+	if (PF.getString("LOW MEMORY")=="yes") {
+		printf("Using low-memory mode (Ap and the preconditioner are recomputed when needed)...\n");
+		Solver.setLowMemory(true);
+	}
+	
+	//STRESS FROM REACTIONS
+	if (PF.getString("STRESS FROM REACTIONS")=="yes") {
+		printf("Computing the stress from the reaction forces only...\n");
+		Solver.setStressFromReactions(true);
+	}
+	
+	//ELIMINATE FIXED VARIABLES
+	if (PF.getString("ELIMINATE FIXED VARIABLES")=="yes") {
+		printf("Reconstructing the reaction forces after the iterations...\n");
+		Solver.setEliminateFixedVariables(true);
+	}
+	
+	//THREADS PER BLOCK
+	if (PF.getInteger("THREADS PER BLOCK")>1) {
+		printf("Setting threads per block = %d\n",PF.getInteger("THREADS PER BLOCK"));
+		Solver.setThreadsPerBlock(PF.getInteger("THREADS PER BLOCK"));
+	}
+	
+	//TILE SIZE
+	if (PF.getString("TILE SIZE")=="auto") {
+		Solver.setTileSize(-1);
+	}
+	else if (PF.getInteger("TILE SIZE")>0) {
+		printf("Setting tile size = %d\n",PF.getInteger("TILE SIZE"));
+		Solver.setTileSize(PF.getInteger("TILE SIZE"));
+	}
+	
 	//Young's modulus, Poission ratio
 	fbreal youngs_modulus=1, poissons_ratio=0.3F;
 	if (PF.getReal("YOUNGS MODULUS")) youngs_modulus=PF.getReal("YOUNGS MODULUS");
@@ -1 +1,3 @@
 ../bin/fbblock solid_10_10_10 test.fes
+../bin/fbblock solid_10_10_10 test_linear.fes
+../bin/fbblock solid_10_10_10 test_linear_interleaved.fes